@@ -0,0 +1,416 @@
+// Microbenchmarks for the per-cell kernels of ParticleWorld, in the style of Google Benchmark.
+// Each benchmark is calibrated until it runs for at least --benchmark_min_time seconds.
+//
+//   bench_kernels [--benchmark_filter=substring] [--benchmark_min_time=0.2] [--benchmark_format=console|json]
+//
+// The *_Wide benchmarks compare the cell layouts: build once as is and once with BENCH_FLAGS=-DGRID_TILED.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include "particle.h"
+#include "scenarios.h"
+
+template <class T>
+inline void DoNotOptimize(T const &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class BenchState
+{
+public:
+    BenchState(long iterations) : _iterations(iterations) {}
+    bool KeepRunning()
+    {
+        if (_count == 0)
+        {
+            _wallStart = std::chrono::steady_clock::now();
+            _cpuStart = std::clock();
+        }
+        if (_count++ < _iterations)
+            return true;
+        _wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _wallStart).count();
+        _cpuSeconds = (double)(std::clock() - _cpuStart) / CLOCKS_PER_SEC;
+        return false;
+    }
+    void setItemsProcessed(long items) { _items = items; }
+    long const getIterations() { return _iterations; }
+    long const getItems() { return _items; }
+    double const getWallSeconds() { return _wallSeconds; }
+    double const getCpuSeconds() { return _cpuSeconds; }
+
+private:
+    long _iterations;
+    long _count = 0;
+    long _items = 0;
+    double _wallSeconds = 0.0;
+    double _cpuSeconds = 0.0;
+    std::chrono::steady_clock::time_point _wallStart;
+    std::clock_t _cpuStart = 0;
+};
+
+typedef void (*BenchFunction)(BenchState &);
+
+struct BenchEntry
+{
+    const char *name;
+    BenchFunction function;
+};
+
+// exposes the protected kernels of ParticleWorld on a small synthetic world
+class KernelHarness : public ParticleWorld
+{
+public:
+    KernelHarness(int width, int height) : ParticleWorld(width, height) { setDeltaTime(0.016); }
+    void Set(int x, int y, Mat_Type type) { SetParticle(x, y, MakeParticle(type)); }
+    void ResetVelocity(int x, int y) { ParticleAtCoord(x, y)->setVelocity(Vector2{2.0f, 1.0f}); }
+    using ParticleWorld::CommitChanges;
+    using ParticleWorld::DiscardMoves;
+    using ParticleWorld::MoveParticle;
+    using ParticleWorld::StepThermal;
+    using ParticleWorld::SwapParticles;
+    using ParticleWorld::TraceMove;
+    using ParticleWorld::UpdateMovable;
+};
+
+#ifdef GRID_TILED
+const char *gridLayout = "tiled";
+#else
+const char *gridLayout = "row-major";
+#endif
+
+const int kernelSize = 64;
+const int cx = kernelSize / 2;
+const int cy = kernelSize / 2;
+
+void RunKernel(BenchState &state, KernelHarness &world)
+{
+    while (state.KeepRunning())
+    {
+        world.ResetVelocity(cx, cy);
+        world.UpdateMovable(cx, cy);
+        world.DiscardMoves();
+    }
+    state.setItemsProcessed(state.getIterations());
+}
+
+void BM_UpdateSand_FreeFall(BenchState &state)
+{
+    KernelHarness world(kernelSize, kernelSize);
+    world.Set(cx, cy, t_sand);
+    RunKernel(state, world);
+}
+
+void BM_UpdateSand_Diagonal(BenchState &state)
+{
+    KernelHarness world(kernelSize, kernelSize);
+    world.Set(cx, cy, t_sand);
+    world.Set(cx, cy + 1, t_solid);
+    RunKernel(state, world);
+}
+
+void BM_UpdateSand_Buried(BenchState &state)
+{
+    KernelHarness world(kernelSize, kernelSize);
+    world.FillRect(cx - 2, cy - 2, cx + 2, cy + 2, t_sand);
+    RunKernel(state, world);
+}
+
+void BM_UpdateWater_FreeFall(BenchState &state)
+{
+    KernelHarness world(kernelSize, kernelSize);
+    world.Set(cx, cy, t_water);
+    RunKernel(state, world);
+}
+
+void BM_UpdateWater_Spread(BenchState &state)
+{
+    KernelHarness world(kernelSize, kernelSize);
+    world.FillRect(0, cy + 1, kernelSize - 1, cy + 1, t_solid);
+    world.Set(cx, cy, t_water);
+    RunKernel(state, world);
+}
+
+void BM_UpdateWater_Submerged(BenchState &state)
+{
+    KernelHarness world(kernelSize, kernelSize);
+    world.FillRect(cx - 2, cy - 2, cx + 2, cy + 2, t_water);
+    RunKernel(state, world);
+}
+
+void BM_UpdateSteam_Rise(BenchState &state)
+{
+    KernelHarness world(kernelSize, kernelSize);
+    world.Set(cx, cy, t_steam);
+    RunKernel(state, world);
+}
+
+void BM_UpdateSteam_Ceiling(BenchState &state)
+{
+    KernelHarness world(kernelSize, kernelSize);
+    world.FillRect(0, cy - 1, kernelSize - 1, cy - 1, t_solid);
+    world.Set(cx, cy, t_steam);
+    RunKernel(state, world);
+}
+
+// proposals from random sand cells in the top half to random water cells in the bottom half;
+// odd iterations propose the reverse moves, so the pairs that swapped swap back and the world
+// stays statistically unchanged between iterations
+void RunCommit(BenchState &state, int moves, int destinations)
+{
+    const int size = 256;
+    KernelHarness world(size, size);
+    world.FillRect(0, 0, size - 1, size / 2 - 1, t_sand);
+    world.FillRect(0, size / 2, size - 1, size - 1, t_water);
+    std::srand(1);
+    std::vector<int> coords;
+    for (int i = 0; i < moves; i++)
+    {
+        coords.push_back(std::rand() % size);
+        coords.push_back(std::rand() % (size / 2));
+        int dst = std::rand() % destinations;
+        coords.push_back(dst % size);
+        coords.push_back(size / 2 + dst / size % (size / 2));
+    }
+    bool reverse = false;
+    while (state.KeepRunning())
+    {
+        int from = reverse ? 2 : 0;
+        int to = reverse ? 0 : 2;
+        for (int i = 0; i < moves; i++)
+            world.MoveParticle(coords[i * 4 + from], coords[i * 4 + from + 1], coords[i * 4 + to], coords[i * 4 + to + 1]);
+        world.CommitChanges();
+        reverse = !reverse;
+    }
+    state.setItemsProcessed(state.getIterations() * moves);
+}
+
+void BM_CommitChanges_1k_Unique(BenchState &state) { RunCommit(state, 1000, 256 * 128); }
+void BM_CommitChanges_1k_Contended(BenchState &state) { RunCommit(state, 1000, 250); }
+void BM_CommitChanges_16k_Unique(BenchState &state) { RunCommit(state, 16000, 256 * 128); }
+
+void BM_CoordToIndex(BenchState &state)
+{
+    const int size = 256;
+    KernelHarness world(size, size);
+    while (state.KeepRunning())
+    {
+        int sum = 0;
+        for (int y = 0; y < size; y++)
+            for (int x = 0; x < size; x++)
+                sum += world.CoordToIndex(x, y);
+        DoNotOptimize(sum);
+    }
+    state.setItemsProcessed(state.getIterations() * size * size);
+}
+
+void BM_IndexToCoord(BenchState &state)
+{
+    const int size = 256;
+    KernelHarness world(size, size);
+    while (state.KeepRunning())
+    {
+        float sum = 0.0f;
+        for (int i = 0; i < size * size; i++)
+        {
+            Vector2 v = world.IndexToCoord(i);
+            sum += v.x + v.y;
+        }
+        DoNotOptimize(sum);
+    }
+    state.setItemsProcessed(state.getIterations() * size * size);
+}
+
+void BM_SwapParticles(BenchState &state)
+{
+    const int size = 256;
+    const int pairs = 4096;
+    KernelHarness world(size, size);
+    std::srand(1);
+    std::vector<int> ids;
+    for (int i = 0; i < pairs * 2; i++)
+        ids.push_back(std::rand() % (size * size));
+    while (state.KeepRunning())
+    {
+        for (int i = 0; i < pairs; i++)
+            world.SwapParticles(ids[i * 2], ids[i * 2 + 1]);
+    }
+    state.setItemsProcessed(state.getIterations() * pairs);
+}
+
+// diffusion plus transition scan over a sand world kept warm by a burner below the melting point
+void RunThermal(BenchState &state, int scale)
+{
+    const int size = 256;
+    KernelHarness world(size, size);
+    world.FillRect(0, 0, size - 1, size - 1, t_sand);
+    world.setThermalScale(scale);
+    world.AddHeat(size / 2, size / 2, size / 4, 500.0f);
+    while (state.KeepRunning())
+    {
+        world.AddHeat(size / 2, size / 2, 8, 1.0f);
+        world.StepThermal();
+    }
+    state.setItemsProcessed(state.getIterations() * size * size);
+}
+
+void BM_StepThermal_Scale1(BenchState &state) { RunThermal(state, 1); }
+void BM_StepThermal_Scale2(BenchState &state) { RunThermal(state, 2); }
+void BM_StepThermal_Scale4(BenchState &state) { RunThermal(state, 4); }
+
+const int wideWidth = 8192;
+const int wideHeight = 512;
+
+// steam walking up 256 cells of open column from random spots along the bottom of a wide world
+void BM_TraceMove_Rise_Wide(BenchState &state)
+{
+    const int columns = 4096;
+    const int rise = 256;
+    KernelHarness world(wideWidth, wideHeight);
+    std::srand(1);
+    std::vector<int> xs;
+    for (int i = 0; i < columns; i++)
+        xs.push_back(std::rand() % wideWidth);
+    unsigned mask = MAT_MASK(t_air);
+    while (state.KeepRunning())
+    {
+        int sum = 0;
+        for (int x : xs)
+        {
+            int outX, outY;
+            world.TraceMove(x, wideHeight - 1, 0, -rise, mask, outX, outY);
+            sum += outY;
+        }
+        DoNotOptimize(sum);
+    }
+    state.setItemsProcessed(state.getIterations() * columns * rise);
+}
+
+// one scan over the bottom 64 rows of a wide world, loose sand and water, moves discarded
+void BM_UpdateMovable_Sweep_Wide(BenchState &state)
+{
+    const int rows = 64;
+    KernelHarness world(wideWidth, wideHeight);
+    std::srand(1);
+    world.FillRect(0, wideHeight - rows, wideWidth - 1, wideHeight - 1, t_sand, 0.5);
+    world.FillRect(0, wideHeight - rows, wideWidth - 1, wideHeight - 1, t_water, 0.25);
+    long movers = 0;
+    while (state.KeepRunning())
+    {
+        movers = 0;
+        for (int y = wideHeight - 1; y >= wideHeight - rows; y--)
+        {
+            for (int x = 0; x < wideWidth; x++)
+            {
+                Particle *p = world.ParticleAtCoord(x, y);
+                if (p->getType() != t_sand && p->getType() != t_water)
+                    continue;
+                world.UpdateMovable(x, y);
+                movers++;
+            }
+            world.DiscardMoves();
+        }
+    }
+    state.setItemsProcessed(state.getIterations() * movers);
+}
+
+static const BenchEntry benchmarks[] = {
+    {"BM_UpdateSand_FreeFall", BM_UpdateSand_FreeFall},
+    {"BM_UpdateSand_Diagonal", BM_UpdateSand_Diagonal},
+    {"BM_UpdateSand_Buried", BM_UpdateSand_Buried},
+    {"BM_UpdateWater_FreeFall", BM_UpdateWater_FreeFall},
+    {"BM_UpdateWater_Spread", BM_UpdateWater_Spread},
+    {"BM_UpdateWater_Submerged", BM_UpdateWater_Submerged},
+    {"BM_UpdateSteam_Rise", BM_UpdateSteam_Rise},
+    {"BM_UpdateSteam_Ceiling", BM_UpdateSteam_Ceiling},
+    {"BM_CommitChanges_1k_Unique", BM_CommitChanges_1k_Unique},
+    {"BM_CommitChanges_1k_Contended", BM_CommitChanges_1k_Contended},
+    {"BM_CommitChanges_16k_Unique", BM_CommitChanges_16k_Unique},
+    {"BM_CoordToIndex", BM_CoordToIndex},
+    {"BM_IndexToCoord", BM_IndexToCoord},
+    {"BM_SwapParticles", BM_SwapParticles},
+    {"BM_StepThermal_Scale1", BM_StepThermal_Scale1},
+    {"BM_StepThermal_Scale2", BM_StepThermal_Scale2},
+    {"BM_StepThermal_Scale4", BM_StepThermal_Scale4},
+    {"BM_TraceMove_Rise_Wide", BM_TraceMove_Rise_Wide},
+    {"BM_UpdateMovable_Sweep_Wide", BM_UpdateMovable_Sweep_Wide},
+};
+
+// grows the iteration count until a run takes at least minTime, like Google Benchmark
+BenchState Measure(BenchFunction function, double minTime)
+{
+    long iterations = 1;
+    while (true)
+    {
+        BenchState state(iterations);
+        function(state);
+        double elapsed = state.getWallSeconds();
+        if (elapsed >= minTime || iterations >= 1000000000L)
+            return state;
+        double multiplier = elapsed > 0.0 ? minTime * 1.4 / elapsed : 10.0;
+        if (multiplier > 10.0 || elapsed < minTime / 10.0)
+            multiplier = 10.0;
+        iterations = (long)(iterations * multiplier) + 1;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string filter;
+    std::string format = "console";
+    double minTime = 0.2;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 19, "--benchmark_filter=") == 0)
+            filter = arg.substr(19);
+        else if (arg.compare(0, 21, "--benchmark_min_time=") == 0)
+            minTime = std::atof(arg.substr(21).c_str());
+        else if (arg.compare(0, 19, "--benchmark_format=") == 0)
+            format = arg.substr(19);
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--benchmark_filter=substring] [--benchmark_min_time=seconds] "
+                                 "[--benchmark_format=console|json]\n",
+                         argv[0]);
+            return 1;
+        }
+    }
+    bool json = format == "json";
+
+    if (json)
+        std::printf("{\n  \"context\": {\"library_build_type\": \"release\", \"min_time\": %g, \"grid_layout\": \"%s\"},\n  \"benchmarks\": [\n",
+                    minTime, gridLayout);
+    else
+    {
+        std::printf("grid layout: %s\n", gridLayout);
+        std::printf("%-32s %14s %14s %12s %14s\n", "Benchmark", "Time (ns)", "CPU (ns)", "Iterations", "items/s");
+    }
+
+    bool first = true;
+    for (const BenchEntry &entry : benchmarks)
+    {
+        if (!filter.empty() && std::string(entry.name).find(filter) == std::string::npos)
+            continue;
+        BenchState state = Measure(entry.function, minTime);
+        double realNs = state.getWallSeconds() * 1e9 / state.getIterations();
+        double cpuNs = state.getCpuSeconds() * 1e9 / state.getIterations();
+        double itemsPerSecond = state.getWallSeconds() > 0.0 ? state.getItems() / state.getWallSeconds() : 0.0;
+        if (json)
+        {
+            std::printf("%s    {\"name\": \"%s\", \"iterations\": %ld, \"real_time\": %.3f, \"cpu_time\": %.3f, "
+                        "\"time_unit\": \"ns\", \"items_per_second\": %.1f}",
+                        first ? "" : ",\n", entry.name, state.getIterations(), realNs, cpuNs, itemsPerSecond);
+        }
+        else
+            std::printf("%-32s %14.1f %14.1f %12ld %14.4g\n", entry.name, realNs, cpuNs, state.getIterations(), itemsPerSecond);
+        first = false;
+    }
+    if (json)
+        std::printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Scenario benchmark: runs every canned scenario through UpdateParticles for a fixed number of
+// steps with a fixed seed and reports throughput and per-step latency percentiles.
+//
+//   bench_world [--width 300] [--height 225] [--steps 600] [--seed 1] [--dt 0.016]
+//               [--scenario name] [--csv] [--trace file.json] [--far-interval N]
+//
+// --far-interval focuses the world on its centre quarter and updates the chunks away from it every N-th step.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "particle.h"
+#include "scenarios.h"
+
+struct BenchResult
+{
+    double totalMs;
+    double p50, p95, p99, maxMs;
+    double avgSwaps;
+};
+
+double PercentileOf(std::vector<double> sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    return sorted[(size_t)(p * (sorted.size() - 1) + 0.5)];
+}
+
+BenchResult RunScenario(Scenario scenario, int width, int height, int steps, unsigned seed, double dt, int farInterval)
+{
+    std::srand(seed);
+    ParticleWorld world(width, height);
+    world.setDeltaTime(dt);
+    world.setFocus(Rectangle{width / 4.0f, height / 4.0f, width / 2.0f, height / 2.0f}, farInterval);
+    BuildScenario(world, scenario, width, height);
+
+    std::vector<double> stepMs;
+    stepMs.reserve(steps);
+    long swaps = 0;
+    for (int i = 0; i < steps; i++)
+    {
+        StepScenario(world, scenario, width, height);
+        auto start = std::chrono::steady_clock::now();
+        world.UpdateParticles();
+        stepMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        swaps += world.getStats().swapsApplied;
+    }
+
+    BenchResult result;
+    result.totalMs = 0.0;
+    for (double ms : stepMs)
+        result.totalMs += ms;
+    std::sort(stepMs.begin(), stepMs.end());
+    result.p50 = PercentileOf(stepMs, 0.50);
+    result.p95 = PercentileOf(stepMs, 0.95);
+    result.p99 = PercentileOf(stepMs, 0.99);
+    result.maxMs = stepMs.empty() ? 0.0 : stepMs.back();
+    result.avgSwaps = steps > 0 ? (double)swaps / steps : 0.0;
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    int width = 300;
+    int height = 225;
+    int steps = 600;
+    unsigned seed = 1;
+    double dt = 0.016;
+    bool csv = false;
+    std::string tracePath;
+    int farInterval = 1;
+    std::vector<Scenario> scenarios;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--width") && hasValue)
+            width = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--height") && hasValue)
+            height = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--steps") && hasValue)
+            steps = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && hasValue)
+            seed = (unsigned)std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--dt") && hasValue)
+            dt = std::atof(argv[++i]);
+        else if (!strcmp(argv[i], "--trace") && hasValue)
+            tracePath = argv[++i];
+        else if (!strcmp(argv[i], "--far-interval") && hasValue)
+            farInterval = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--csv"))
+            csv = true;
+        else if (!strcmp(argv[i], "--scenario") && hasValue)
+        {
+            Scenario s = ScenarioFromName(argv[++i]);
+            if (s == scenario_count)
+            {
+                std::fprintf(stderr, "unknown scenario %s\n", argv[i]);
+                return 1;
+            }
+            scenarios.push_back(s);
+        }
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--width N] [--height N] [--steps N] [--seed N] [--dt S] "
+                                 "[--scenario name]... [--csv] [--trace file.json] [--far-interval N]\n",
+                         argv[0]);
+            return 1;
+        }
+    }
+    if (scenarios.empty())
+        for (int i = 0; i < scenario_count; i++)
+            scenarios.push_back((Scenario)i);
+
+    if (!tracePath.empty() && !TraceWriter::Get().Begin(tracePath))
+        return 1;
+
+    if (csv)
+        std::printf("scenario,width,height,steps,seed,total_ms,steps_per_s,mcells_per_s,p50_ms,p95_ms,p99_ms,max_ms,avg_swaps\n");
+    else
+        std::printf("%-16s %10s %10s %10s %8s %8s %8s %8s %10s\n", "scenario", "total ms", "steps/s", "Mcells/s",
+                    "p50", "p95", "p99", "max", "swaps/step");
+
+    for (Scenario scenario : scenarios)
+    {
+        BenchResult r = RunScenario(scenario, width, height, steps, seed, dt, farInterval);
+        double stepsPerSecond = r.totalMs > 0.0 ? steps / (r.totalMs / 1000.0) : 0.0;
+        double mcells = stepsPerSecond * width * height / 1e6;
+        if (csv)
+            std::printf("%s,%d,%d,%d,%u,%.3f,%.1f,%.2f,%.4f,%.4f,%.4f,%.4f,%.1f\n", scenarioNames[scenario], width, height,
+                        steps, seed, r.totalMs, stepsPerSecond, mcells, r.p50, r.p95, r.p99, r.maxMs, r.avgSwaps);
+        else
+            std::printf("%-16s %10.1f %10.1f %10.2f %8.3f %8.3f %8.3f %8.3f %10.1f\n", scenarioNames[scenario], r.totalMs,
+                        stepsPerSecond, mcells, r.p50, r.p95, r.p99, r.maxMs, r.avgSwaps);
+    }
+
+    TraceWriter::Get().End();
+    return 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <raylib.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// contents of one chunk: cell types, colors and remaining lifetimes, row by row
+struct ChunkImage
+{
+    int chunk = -1;
+    int x = 0; // cell rectangle the image covers
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<unsigned char> types;
+    std::vector<Color> colors;
+    std::vector<int> life;
+};
+
+// Copy-on-write view of a world frozen at one step. While an epoch is attached to a ParticleWorld, the
+// first write to each chunk copies the chunk's old contents into the epoch, so a reader can see every
+// chunk as it was at the start without stopping the simulation. A background reader claims chunks that
+// have not been written yet and reads them straight from the world; a writer reaching a claimed chunk
+// waits the few microseconds until the reader is done with it.
+class CowEpoch
+{
+public:
+    CowEpoch(int chunks) : _state(new std::atomic<unsigned char>[chunks]), _images(chunks), _chunks(chunks)
+    {
+        for (int i = 0; i < chunks; i++)
+            _state[i].store(cow_live, std::memory_order_relaxed);
+    }
+    int const getChunks() { return _chunks; }
+    // writer side: true if the caller must copy the chunk into Image(chunk) and then call Copied(chunk)
+    bool BeforeWrite(int chunk);
+    void Copied(int chunk) { _state[chunk].store(cow_copied, std::memory_order_release); }
+    // reader side: true if the chunk is still untouched and the caller may read it from the world, then
+    // call DoneReading; false once Image(chunk) holds the frozen copy
+    bool BeginRead(int chunk);
+    void DoneReading(int chunk) { _state[chunk].store(cow_read, std::memory_order_release); }
+    ChunkImage &Image(int chunk) { return _images[chunk]; }
+    bool IsCopied(int chunk) { return _state[chunk].load(std::memory_order_acquire) == cow_copied; }
+
+private:
+    enum State : unsigned char
+    {
+        cow_live,    // unchanged since the epoch, nobody holds it
+        cow_reading, // the reader is reading it from the world
+        cow_read,    // the reader is done; later writes need no copy
+        cow_copying, // a writer is copying it
+        cow_copied,  // Image holds the frozen contents
+    };
+    std::unique_ptr<std::atomic<unsigned char>[]> _state;
+    std::vector<ChunkImage> _images;
+    int _chunks;
+};
+
+bool CowEpoch::BeforeWrite(int chunk)
+{
+    unsigned char state = _state[chunk].load(std::memory_order_acquire);
+    if (state == cow_live && _state[chunk].compare_exchange_strong(state, cow_copying, std::memory_order_acquire))
+        return true;
+    while (state == cow_reading)
+    {
+        std::this_thread::yield();
+        state = _state[chunk].load(std::memory_order_acquire);
+    }
+    return false;
+}
+
+bool CowEpoch::BeginRead(int chunk)
+{
+    unsigned char state = cow_live;
+    if (_state[chunk].compare_exchange_strong(state, cow_reading, std::memory_order_acquire))
+        return true;
+    while (state == cow_copying)
+    {
+        std::this_thread::yield();
+        state = _state[chunk].load(std::memory_order_acquire);
+    }
+    return false;
+}
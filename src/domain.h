@@ -0,0 +1,384 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <new>
+#include <vector>
+#include "particle.h"
+#include "scenarios.h"
+#ifndef _WIN32
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Domain-decomposed simulation: the world is cut into horizontal strips, each simulated by its own
+// process in a ParticleWorld covering the strip plus STRIP_HALO rows of its neighbours. Every step the
+// processes publish their edge rows and the particles that moved out of their strip into a shared
+// mapping, wait on a barrier, and copy their neighbours' data into their halo rows.
+//
+// Only the grid kernels and flying particles cross strip boundaries. Water equalization is off in strip
+// mode and heat stays inside the strip that owns it. Rigid bodies are not supported, so scenarios with
+// bodies are rejected. Every rank builds its rows and runs the scenario emitters in the scenario's
+// coordinates, clipped to its own rows.
+
+#define STRIP_HALO 8 // rows of each neighbour mirrored above and below a strip
+
+static size_t AlignUp(size_t value) { return (value + 63) & ~(size_t)63; } // cache line
+
+// spin barrier living in shared memory; lock-free atomics work across processes
+struct SharedBarrier
+{
+    std::atomic<int> arrived{0};
+    std::atomic<int> generation{0};
+    void Wait(int parties);
+};
+
+struct StripHeader
+{
+    SharedBarrier barrier;
+    std::atomic<long> migrations{0};
+    std::atomic<long> lost{0};
+    std::atomic<long> swaps{0};
+    std::atomic<long> flying{0}; // still in flight at the end, so missing from the final frame
+    std::atomic<long> initial[MAT_COUNT] = {}; // material counts of the world as the ranks built it
+};
+
+// where each rank's slice of the shared mapping lives
+struct StripLayout
+{
+    int ranks;
+    int width;
+    int height;
+    int stripRows;  // rows of every strip, the first extraRows strips get one more
+    int extraRows;
+    int migrationCapacity;
+    size_t edgeBytes;    // halo rows of types followed by halo rows of colors
+    size_t mailboxBytes; // count followed by migrations
+    size_t rankBytes;
+    size_t frameOffset; // final types of the whole world, written once at the end
+    size_t totalBytes;
+
+    StripLayout(int ranks, int width, int height);
+    int OwnedTop(int rank) { return rank * stripRows + std::min(rank, extraRows); }
+    int OwnedBottom(int rank) { return OwnedTop(rank + 1) - 1; }
+    // edge 0 is the top rows of the strip, edge 1 the bottom rows
+    unsigned char *EdgeTypes(char *base, int rank, int edge) { return (unsigned char *)(base + RankOffset(rank) + edge * edgeBytes); }
+    Color *EdgeColors(char *base, int rank, int edge) { return (Color *)(EdgeTypes(base, rank, edge) + STRIP_HALO * width); }
+    // mailbox 0 holds migrations to the rank above, mailbox 1 to the rank below
+    int *MailboxCount(char *base, int rank, int box) { return (int *)(base + RankOffset(rank) + 2 * edgeBytes + box * mailboxBytes); }
+    Migration *Mailbox(char *base, int rank, int box) { return (Migration *)(MailboxCount(base, rank, box) + 2); }
+
+private:
+    size_t RankOffset(int rank) { return AlignUp(sizeof(StripHeader)) + rank * rankBytes; }
+};
+
+// runs a scenario headless across several processes and prints throughput and a conservation check;
+// returns a process exit code
+int RunStrips(int ranks, Scenario scenario, int width, int height, int steps, unsigned seed, double dt);
+
+void SharedBarrier::Wait(int parties)
+{
+    int gen = generation.load(std::memory_order_acquire);
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == parties)
+    {
+        arrived.store(0, std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        return;
+    }
+    while (generation.load(std::memory_order_acquire) == gen)
+    {
+#ifndef _WIN32
+        sched_yield();
+#endif
+    }
+}
+
+StripLayout::StripLayout(int ranks, int width, int height) : ranks(ranks), width(width), height(height)
+{
+    stripRows = height / ranks;
+    extraRows = height % ranks;
+    // one move wins each halo cell, plus the particles sent back from the last round
+    migrationCapacity = 2 * width * STRIP_HALO;
+    edgeBytes = AlignUp(STRIP_HALO * width * (1 + sizeof(Color)));
+    mailboxBytes = AlignUp(2 * sizeof(int) + migrationCapacity * sizeof(Migration));
+    rankBytes = 2 * edgeBytes + 2 * mailboxBytes;
+    frameOffset = AlignUp(sizeof(StripHeader)) + ranks * rankBytes;
+    totalBytes = frameOffset + AlignUp(width * height);
+}
+
+#ifndef _WIN32
+
+// Pins a rank to one of the CPUs the run may use, spread evenly so neighbouring strips share a socket
+// when CPUs are numbered socket by socket. A rank then first-touches its world's pages on its own NUMA
+// node and keeps running next to them. Left alone when there are more ranks than CPUs.
+static void PinRank(int rank, int ranks)
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) < ranks)
+        return;
+    int slot = (int)((long)rank * CPU_COUNT(&allowed) / ranks);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed) || slot-- > 0)
+            continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        sched_setaffinity(0, sizeof(one), &one);
+        return;
+    }
+#endif
+}
+
+// puts a particle that came back from a neighbour into its own strip again: in the column it left if
+// that still holds a particle of the type it displaced, otherwise in the nearest column that does
+static bool PlaceBounced(ParticleWorld &local, Migration m)
+{
+    int x = m.x;
+    for (int d = 0; d < local.getWidth(); d++)
+    {
+        for (int side = -1; side <= 1; side += 2)
+        {
+            m.x = x + side * d;
+            if ((d > 0 || side < 0) && local.ReceiveMigration(m))
+                return true;
+        }
+    }
+    return false;
+}
+
+static void RunStripRank(StripHeader *header, char *base, StripLayout layout, int rank, Scenario scenario, int steps, unsigned seed, double dt)
+{
+    PinRank(rank, layout.ranks);
+    int width = layout.width;
+    int ownedTop = layout.OwnedTop(rank);
+    int ownedBottom = layout.OwnedBottom(rank);
+    int localTop = std::max(ownedTop - STRIP_HALO, 0);
+    int localBottom = std::min(ownedBottom + STRIP_HALO, layout.height - 1);
+    bool hasAbove = rank > 0;
+    bool hasBelow = rank + 1 < layout.ranks;
+
+    // every rank builds only its own rows of the scenario; the halo rows arrive with the first exchange
+    std::srand(seed + rank + 1);
+    ParticleWorld local(width, localBottom - localTop + 1);
+    local.setDeltaTime(dt);
+    local.setWaterEqualization(false);
+    local.setOwnedRows(ownedTop - localTop, ownedBottom - localTop);
+    BuildScenario(local, scenario, width, layout.height, localTop);
+    std::vector<unsigned char> types(width);
+    std::vector<Color> colors(width);
+    for (int y = ownedTop; y <= ownedBottom; y++)
+    {
+        local.ReadRow(y - localTop, types.data(), colors.data());
+        for (int x = 0; x < width; x++)
+            header->initial[types[x]].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    long swaps = 0;
+    std::vector<Migration> carried; // scratch for what did not fit into a mailbox, sent in the next round
+    std::vector<Migration> pending; // came back and found no place yet, retried every round
+    for (int step = 0; step <= steps + 1; step++)
+    {
+        // publish edge rows and the particles that left the strip in the last step
+        for (int edge = 0; edge < 2; edge++)
+        {
+            int first = edge == 0 ? ownedTop : ownedBottom - STRIP_HALO + 1;
+            for (int row = 0; row < STRIP_HALO; row++)
+                local.ReadRow(first + row - localTop, layout.EdgeTypes(base, rank, edge) + row * width,
+                              layout.EdgeColors(base, rank, edge) + row * width);
+        }
+        int counts[2] = {0, 0};
+        carried.clear();
+        for (const Migration &m : local.getOutbox())
+        {
+            int y = m.y + localTop;
+            int box = y < ownedTop ? 0 : 1;
+            if (counts[box] >= layout.migrationCapacity)
+            {
+                carried.push_back(m);
+                continue;
+            }
+            Migration global = m;
+            global.y = y;
+            global.fromY = m.fromY + localTop;
+            layout.Mailbox(base, rank, box)[counts[box]++] = global;
+        }
+        *layout.MailboxCount(base, rank, 0) = counts[0];
+        *layout.MailboxCount(base, rank, 1) = counts[1];
+        header->migrations.fetch_add(counts[0] + counts[1]);
+        local.getOutbox().swap(carried);
+        carried.clear();
+        header->barrier.Wait(layout.ranks);
+
+        // mirror the neighbours' edges into the halo and take in the particles they handed over
+        if (hasAbove)
+        {
+            for (int row = 0; row < STRIP_HALO; row++)
+                local.WriteRow(ownedTop - STRIP_HALO + row - localTop, layout.EdgeTypes(base, rank - 1, 1) + row * width,
+                               layout.EdgeColors(base, rank - 1, 1) + row * width);
+        }
+        if (hasBelow)
+        {
+            for (int row = 0; row < STRIP_HALO; row++)
+                local.WriteRow(ownedBottom + 1 + row - localTop, layout.EdgeTypes(base, rank + 1, 0) + row * width,
+                               layout.EdgeColors(base, rank + 1, 0) + row * width);
+        }
+        int sources[2][2] = {{rank - 1, 1}, {rank + 1, 0}}; // neighbour and the mailbox it addressed to us
+        for (auto &source : sources)
+        {
+            if (source[0] < 0 || source[0] >= layout.ranks)
+                continue;
+            int count = *layout.MailboxCount(base, source[0], source[1]);
+            Migration *box = layout.Mailbox(base, source[0], source[1]);
+            for (int i = 0; i < count; i++)
+            {
+                Migration m = box[i];
+                m.y -= localTop;
+                m.fromY -= localTop;
+                if (local.ReceiveMigration(m))
+                    continue;
+                if (m.bounced)
+                {
+                    pending.push_back(m);
+                    continue;
+                }
+                // no room here: send it back, where it takes the place of the particle it was swapped with
+                Migration back = m;
+                std::swap(back.x, back.fromX);
+                std::swap(back.y, back.fromY);
+                back.bounced = true;
+                local.getOutbox().push_back(back);
+            }
+        }
+        header->barrier.Wait(layout.ranks);
+        size_t kept = 0;
+        for (const Migration &m : pending)
+            if (!PlaceBounced(local, m))
+                pending[kept++] = m;
+        pending.resize(kept);
+
+        if (step >= steps)
+            continue; // the last two rounds only flush the outboxes and send back what did not fit
+        // the emitters draw from a stream all ranks share, so they agree on where a blast goes; each rank
+        // emits into its own rows only
+        std::srand(seed + 1000003u * (step + 1));
+        StepScenario(local, scenario, width, layout.height, localTop);
+        std::srand(seed + rank + 1 + 1000003u * (step + 1));
+        local.UpdateParticles();
+        swaps += local.getStats().swapsApplied;
+    }
+
+    unsigned char *frame = (unsigned char *)(base + layout.frameOffset);
+    for (int y = ownedTop; y <= ownedBottom; y++)
+        local.ReadRow(y - localTop, frame + y * width, colors.data());
+    header->swaps.fetch_add(swaps);
+    header->lost.fetch_add(local.getOutbox().size() + pending.size());
+    header->flying.fetch_add(local.getFlying().size());
+}
+
+int RunStrips(int ranks, Scenario scenario, int width, int height, int steps, unsigned seed, double dt)
+{
+    // every strip needs at least its edge rows of its own
+    if (ranks < 1 || StripLayout(ranks, width, height).stripRows < STRIP_HALO)
+    {
+        std::fprintf(stderr, "need 1 to %d ranks for a world %d rows high\n", height / STRIP_HALO, height);
+        return 1;
+    }
+    if (ScenarioHasBodies(scenario))
+    {
+        std::fprintf(stderr, "%s has rigid bodies, which strip runs do not support\n", scenarioNames[scenario]);
+        return 1;
+    }
+    StripLayout layout(ranks, width, height);
+    // an anonymous shared mapping is inherited by the forked ranks
+    void *mapping = mmap(nullptr, layout.totalBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        std::perror("mmap");
+        return 1;
+    }
+    char *base = (char *)mapping;
+    StripHeader *header = new (base) StripHeader();
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<pid_t> children;
+    for (int rank = 0; rank < ranks; rank++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            RunStripRank(header, base, layout, rank, scenario, steps, seed, dt);
+            _exit(0);
+        }
+        if (pid < 0)
+        {
+            // the ranks already started would wait for this one forever
+            std::perror("fork");
+            for (pid_t child : children)
+            {
+                kill(child, SIGKILL);
+                waitpid(child, nullptr, 0);
+            }
+            header->~StripHeader();
+            munmap(mapping, layout.totalBytes);
+            return 1;
+        }
+        children.push_back(pid);
+    }
+    // a rank that dies leaves the others waiting on the barrier forever, so they are stopped as well
+    bool failed = false;
+    while (!children.empty())
+    {
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+            break;
+        children.erase(std::find(children.begin(), children.end(), pid));
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            continue;
+        if (!failed)
+            std::fprintf(stderr, "a rank exited abnormally, stopping the others\n");
+        failed = true;
+        for (pid_t child : children)
+            kill(child, SIGKILL);
+    }
+    if (failed)
+    {
+        header->~StripHeader();
+        munmap(mapping, layout.totalBytes);
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // compare the material totals with the starting world; emitters add material on top of that
+    long before[MAT_COUNT] = {0};
+    long after[MAT_COUNT] = {0};
+    for (int i = 0; i < MAT_COUNT; i++)
+        before[i] = header->initial[i].load();
+    const unsigned char *frame = (const unsigned char *)(base + layout.frameOffset);
+    for (size_t i = 0; i < (size_t)width * height; i++)
+        after[frame[i]]++;
+    std::printf("%s: %d ranks, %dx%d, %d steps in %.1f ms (%.1f steps/s), %.1f swaps/step, %ld migrations, %ld lost, %ld in flight\n",
+                scenarioNames[scenario], ranks, width, height, steps, seconds * 1000.0, steps / seconds,
+                (double)header->swaps.load() / std::max(steps, 1), header->migrations.load(), header->lost.load(), header->flying.load());
+    for (int i = 0; i < MAT_COUNT; i++)
+        if (before[i] || after[i])
+            std::printf("  %-6s %8ld -> %8ld\n", materialInfo[i].name, before[i], after[i]);
+    header->~StripHeader();
+    munmap(mapping, layout.totalBytes);
+    return failed ? 1 : 0;
+}
+
+#else
+
+int RunStrips(int ranks, Scenario scenario, int width, int height, int steps, unsigned seed, double dt)
+{
+    std::fprintf(stderr, "multi-process strips need POSIX shared memory and fork\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,224 @@
+#pragma once
+#include <raylib.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "particle.h"
+
+// Writes every N-th frame of a world without a window: either one PNG per frame through raylib's image
+// export, or raw RGBA frames to stdout for an encoder, e.g.
+//   game --headless --export raw | ffmpeg -f rawvideo -pix_fmt rgba -s 300x225 -i - out.mp4
+// The simulation thread only copies the colors into a pooled buffer; scaling, PNG compression and the
+// writes happen on worker threads. When every buffer is in flight Capture waits, so a slow disk slows
+// the simulation down instead of growing memory without bound.
+
+#define EXPORT_BUFFERS_PER_THREAD 2
+
+enum ExportFormat
+{
+    export_png,
+    export_raw,
+};
+
+class FrameExporter
+{
+public:
+    ~FrameExporter() { Close(); }
+    // directory is only used for PNGs; raw frames are written in order by a single worker
+    bool Open(ExportFormat format, const std::string &directory, int every, int scale, int threads);
+    void Capture(ParticleWorld &world, long step); // exports the frame if step is a multiple of every
+    void Close();                                   // waits for the queued frames to be written
+    long const getWritten() { return _written; }
+    long const getFailed() { return _failed; }
+    double const getStallMs() { return _stallMs; } // time Capture spent waiting for a free buffer
+
+private:
+    struct Job
+    {
+        long step;
+        int buffer;
+    };
+    void Work();
+    bool WriteFrame(const Job &job, std::vector<Color> &scaled);
+
+    ExportFormat _format = export_png;
+    std::string _directory;
+    int _every = 1;
+    int _scale = 1;
+    int _width = 0;
+    int _height = 0;
+    std::vector<std::vector<Color>> _buffers;
+    std::vector<int> _freeBuffers;
+    std::deque<Job> _queue;
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _workReady;
+    std::condition_variable _bufferFree;
+    bool _closing = false;
+    long _written = 0;
+    long _failed = 0;
+    double _stallMs = 0.0;
+};
+
+ExportFormat ExportFormatFromName(const char *name, bool &ok);
+
+bool FrameExporter::Open(ExportFormat format, const std::string &directory, int every, int scale, int threads)
+{
+    Close();
+    _format = format;
+    _directory = directory.empty() ? "." : directory;
+    _every = std::max(every, 1);
+    _scale = std::max(scale, 1);
+    _width = 0;
+    _height = 0;
+    // raw frames have to reach the pipe in step order
+    threads = format == export_raw ? 1 : std::max(threads, 1);
+    _buffers.assign(threads * EXPORT_BUFFERS_PER_THREAD, std::vector<Color>());
+    _freeBuffers.clear();
+    for (int i = 0; i < (int)_buffers.size(); i++)
+        _freeBuffers.push_back(i);
+    _closing = false;
+    _written = 0;
+    _failed = 0;
+    _stallMs = 0.0;
+    if (format == export_png && !DirectoryExists(_directory.c_str()))
+    {
+        std::fprintf(stderr, "export directory %s does not exist\n", _directory.c_str());
+        return false;
+    }
+    for (int i = 0; i < threads; i++)
+        _workers.emplace_back(&FrameExporter::Work, this);
+    return true;
+}
+
+void FrameExporter::Capture(ParticleWorld &world, long step)
+{
+    if (_workers.empty() || step % _every != 0)
+        return;
+    int buffer;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_freeBuffers.empty())
+        {
+            auto start = std::chrono::steady_clock::now();
+            _bufferFree.wait(lock, [this] { return !_freeBuffers.empty(); });
+            _stallMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        buffer = _freeBuffers.back();
+        _freeBuffers.pop_back();
+    }
+    // the frame size is fixed by the first capture
+    if (_width == 0)
+    {
+        _width = world.getWidth();
+        _height = world.getHeight();
+    }
+    std::vector<Color> &colors = _buffers[buffer];
+    colors.resize(_width * _height);
+    std::vector<unsigned char> types(_width);
+    for (int y = 0; y < _height; y++)
+        world.ReadRow(y, types.data(), &colors[y * _width]);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(Job{step, buffer});
+    }
+    _workReady.notify_one();
+}
+
+void FrameExporter::Close()
+{
+    if (_workers.empty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closing = true;
+    }
+    _workReady.notify_all();
+    for (std::thread &worker : _workers)
+        worker.join();
+    _workers.clear();
+    if (_format == export_raw)
+        std::fflush(stdout);
+}
+
+void FrameExporter::Work()
+{
+    std::vector<Color> scaled;
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _workReady.wait(lock, [this] { return _closing || !_queue.empty(); });
+            if (_queue.empty())
+                return;
+            job = _queue.front();
+            _queue.pop_front();
+        }
+        bool ok = WriteFrame(job, scaled);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _freeBuffers.push_back(job.buffer);
+            if (ok)
+                _written++;
+            else
+                _failed++;
+        }
+        _bufferFree.notify_one();
+    }
+}
+
+bool FrameExporter::WriteFrame(const Job &job, std::vector<Color> &scaled)
+{
+    std::vector<Color> &colors = _buffers[job.buffer];
+    int width = _width * _scale;
+    int height = _height * _scale;
+    Color *pixels = colors.data();
+    if (_scale > 1)
+    {
+        // nearest-neighbour upscale so each cell stays a crisp square
+        scaled.resize(width * height);
+        for (int y = 0; y < height; y++)
+        {
+            const Color *row = &colors[(y / _scale) * _width];
+            Color *out = &scaled[y * width];
+            for (int x = 0; x < width; x++)
+                out[x] = row[x / _scale];
+        }
+        pixels = scaled.data();
+    }
+    if (_format == export_raw)
+        return std::fwrite(pixels, sizeof(Color), width * height, stdout) == (size_t)(width * height);
+    // encoded to memory and written here: ExportImage picks the format through IsFileExtension, and like
+    // TextFormat that uses static buffers that are not thread safe
+    Image image = {pixels, width, height, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+    int size = 0;
+    unsigned char *png = ExportImageToMemory(image, ".png", &size);
+    if (!png)
+        return false;
+    char name[32];
+    std::snprintf(name, sizeof(name), "/frame_%06ld.png", job.step);
+    FILE *file = std::fopen((_directory + name).c_str(), "wb");
+    bool ok = file && std::fwrite(png, 1, size, file) == (size_t)size;
+    if (file && std::fclose(file) != 0)
+        ok = false;
+    MemFree(png);
+    return ok;
+}
+
+ExportFormat ExportFormatFromName(const char *name, bool &ok)
+{
+    ok = true;
+    if (std::strcmp(name, "png") == 0)
+        return export_png;
+    if (std::strcmp(name, "raw") == 0)
+        return export_raw;
+    ok = false;
+    return export_png;
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include <raylib.h>
+#include <vector>
+
+#define FLY_EJECT_SPEED 12.0f // sideways or upward speed, in cells per step, at which a particle leaves the grid
+#define FLY_SETTLE_SPEED 1.0f // a flying particle slower than this drops back into the grid
+#define FLY_DRAG 0.98f        // share of its velocity a flying particle keeps each step
+
+// Particles that left the grid, kept as parallel arrays so the integration loop vectorizes.
+// Positions are in cells, velocities in cells per step.
+class FlyingParticles
+{
+public:
+    void Add(float x, float y, float vx, float vy, unsigned char type, Color color, int life);
+    void Remove(int i); // swaps the last particle into slot i
+    void Stop(int i, float x, float y); // keeps the particle in flight at (x, y) with no velocity
+    void Clear();
+    void Integrate(float gravity, float drag); // advances every particle by one step, remembering where it started
+    int const size() { return (int)_x.size(); }
+    float const getX(int i) { return _x[i]; }
+    float const getY(int i) { return _y[i]; }
+    float const getPrevX(int i) { return _prevX[i]; }
+    float const getPrevY(int i) { return _prevY[i]; }
+    float const getVelocityX(int i) { return _vx[i]; }
+    float const getVelocityY(int i) { return _vy[i]; }
+    unsigned char const getType(int i) { return _type[i]; }
+    Color const getColor(int i) { return _color[i]; }
+    int const getLife(int i) { return _life[i]; }
+
+private:
+    std::vector<float> _x;
+    std::vector<float> _y;
+    std::vector<float> _prevX;
+    std::vector<float> _prevY;
+    std::vector<float> _vx;
+    std::vector<float> _vy;
+    std::vector<unsigned char> _type;
+    std::vector<Color> _color;
+    std::vector<int> _life;
+};
+
+void FlyingParticles::Add(float x, float y, float vx, float vy, unsigned char type, Color color, int life)
+{
+    _x.push_back(x);
+    _y.push_back(y);
+    _prevX.push_back(x);
+    _prevY.push_back(y);
+    _vx.push_back(vx);
+    _vy.push_back(vy);
+    _type.push_back(type);
+    _color.push_back(color);
+    _life.push_back(life);
+}
+
+void FlyingParticles::Remove(int i)
+{
+    int last = size() - 1;
+    _x[i] = _x[last];
+    _y[i] = _y[last];
+    _prevX[i] = _prevX[last];
+    _prevY[i] = _prevY[last];
+    _vx[i] = _vx[last];
+    _vy[i] = _vy[last];
+    _type[i] = _type[last];
+    _color[i] = _color[last];
+    _life[i] = _life[last];
+    _x.pop_back();
+    _y.pop_back();
+    _prevX.pop_back();
+    _prevY.pop_back();
+    _vx.pop_back();
+    _vy.pop_back();
+    _type.pop_back();
+    _color.pop_back();
+    _life.pop_back();
+}
+
+void FlyingParticles::Stop(int i, float x, float y)
+{
+    _x[i] = x;
+    _y[i] = y;
+    _prevX[i] = x;
+    _prevY[i] = y;
+    _vx[i] = 0.0f;
+    _vy[i] = 0.0f;
+}
+
+void FlyingParticles::Clear()
+{
+    _x.clear();
+    _y.clear();
+    _prevX.clear();
+    _prevY.clear();
+    _vx.clear();
+    _vy.clear();
+    _type.clear();
+    _color.clear();
+    _life.clear();
+}
+
+void FlyingParticles::Integrate(float gravity, float drag)
+{
+    int n = size();
+    float *x = _x.data();
+    float *y = _y.data();
+    float *prevX = _prevX.data();
+    float *prevY = _prevY.data();
+    float *vx = _vx.data();
+    float *vy = _vy.data();
+    for (int i = 0; i < n; i++)
+    {
+        prevX[i] = x[i];
+        prevY[i] = y[i];
+        vx[i] *= drag;
+        vy[i] = vy[i] * drag + gravity;
+        x[i] += vx[i];
+        y[i] += vy[i];
+    }
+}
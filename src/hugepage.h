@@ -0,0 +1,91 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <vector>
+#if defined(__linux__) && !defined(NO_HUGE_PAGES)
+#include <sys/mman.h>
+#endif
+
+// Allocator for the large per-cell arrays of a world. On Linux, blocks of at least HUGE_PAGE_SIZE are
+// mapped on their own and advised as transparent huge pages, which cuts TLB misses when the scan walks
+// gigabytes of cells. Define GRID_HUGETLB to ask for explicit huge pages first (they must be reserved,
+// e.g. in /proc/sys/vm/nr_hugepages), and NO_HUGE_PAGES to use plain operator new everywhere.
+//
+// The pages are not touched here, so they land on the NUMA node of whichever thread or process first
+// writes them; the world fills its arrays in the constructor, and strip ranks build their own world.
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+template <class T>
+struct HugePageAllocator
+{
+    typedef T value_type;
+
+    HugePageAllocator() = default;
+    template <class U>
+    HugePageAllocator(const HugePageAllocator<U> &) {}
+
+    T *allocate(size_t n);
+    void deallocate(T *p, size_t n);
+
+    template <class U>
+    bool operator==(const HugePageAllocator<U> &) const { return true; }
+    template <class U>
+    bool operator!=(const HugePageAllocator<U> &) const { return false; }
+
+private:
+    static size_t MappedBytes(size_t n) { return (n * sizeof(T) + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1); }
+    static bool Mapped(size_t n) { return n * sizeof(T) >= HUGE_PAGE_SIZE; }
+};
+
+template <class T>
+using HugeVector = std::vector<T, HugePageAllocator<T>>;
+
+#if defined(__linux__) && !defined(NO_HUGE_PAGES)
+
+template <class T>
+T *HugePageAllocator<T>::allocate(size_t n)
+{
+    if (!Mapped(n))
+        return (T *)::operator new(n * sizeof(T));
+    size_t bytes = MappedBytes(n);
+    void *p = MAP_FAILED;
+#if defined(GRID_HUGETLB) && defined(MAP_HUGETLB)
+    p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+    {
+        p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+        madvise(p, bytes, MADV_HUGEPAGE); // only a hint; without THP the mapping simply keeps small pages
+#endif
+    }
+    return (T *)p;
+}
+
+template <class T>
+void HugePageAllocator<T>::deallocate(T *p, size_t n)
+{
+    if (!Mapped(n))
+        ::operator delete(p);
+    else
+        munmap(p, MappedBytes(n));
+}
+
+#else
+
+template <class T>
+T *HugePageAllocator<T>::allocate(size_t n)
+{
+    return (T *)::operator new(n * sizeof(T));
+}
+
+template <class T>
+void HugePageAllocator<T>::deallocate(T *p, size_t)
+{
+    ::operator delete(p);
+}
+
+#endif
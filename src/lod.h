@@ -0,0 +1,292 @@
+#pragma once
+#include <raylib.h>
+#include <algorithm>
+#include <vector>
+#include "particle.h"
+
+#define LOD_LEVELS 5 // level 0 is one texel per cell, each level above halves both sides
+#define LOD_TILE 32  // texels per side of the tiles each level tracks damage in
+#define LOD_PAGE 256 // texels per side of the textures levels are drawn from, a whole number of tiles
+
+// Mipmapped colors of the world, kept up to date from the damage the world reports instead of being
+// rebuilt: only the damaged cells are read back, and each level above only averages the texels under
+// them. Zoomed-out views draw a coarse level rather than every cell. Every level remembers which of its
+// tiles changed since they were last uploaded, so the pages drawn from it can be refreshed in place.
+class ColorPyramid
+{
+public:
+    void Resize(int width, int height, int levels = LOD_LEVELS);
+    void Update(ParticleWorld &world, const std::vector<Rectangle> &damage); // damage in cells
+    int const getLevels() { return (int)_levels.size(); }
+    int const getLevelWidth(int level) { return _levels[level].width; }
+    int const getLevelHeight(int level) { return _levels[level].height; }
+    const Color *getLevel(int level) { return _levels[level].colors.data(); }
+    int LevelForScale(float pixelsPerCell); // coarsest level that still has a texel for every screen pixel
+    unsigned const getChanges(int level) { return _levels[level].changes; } // grows whenever the level changes
+    // uploads the tiles of the given page of a level that changed since they were last uploaded, or all of
+    // them, to the texel at the page's corner; the other pages' tiles stay dirty until they are uploaded
+    void UploadPage(int level, int pageX, int pageY, Texture2D &texture, bool all);
+    void CopyRect(int level, Rectangle rect, std::vector<Color> &out); // packed rows, e.g. for UpdateTextureRec
+    void Sample(int level, int width, int height, std::vector<Color> &out); // the whole level, point sampled
+
+private:
+    struct Level
+    {
+        int width = 0;
+        int height = 0;
+        int tilesX = 0;
+        int tilesY = 0;
+        unsigned changes = 0;
+        std::vector<Color> colors;
+        std::vector<unsigned char> tileDirty;
+    };
+    void MarkTiles(Level &level, int x0, int y0, int x1, int y1); // inclusive texel bounds
+    std::vector<Level> _levels;
+    std::vector<Color> _scratch;
+};
+
+// A fixed number of page textures the visible part of a level is drawn from, so no texture is ever the
+// size of a level. A page is loaded when it comes into view, in the slot of the page drawn least recently,
+// and after that only its changed tiles are uploaded.
+class PyramidPages
+{
+public:
+    // enough pages for a screen of the given size at any zoom the pyramid picks a level for
+    void Reserve(int screenWidth, int screenHeight);
+    // draws the texels of a level inside visible, each texel texelSize units wide; call once per frame
+    void Draw(ColorPyramid &pyramid, int level, Rectangle visible, float texelSize);
+    void Unload();
+
+private:
+    struct Page
+    {
+        int level = -1;
+        int x = 0;
+        int y = 0;
+        unsigned drawn = 0; // frame it was last drawn in
+        Texture2D texture = {0};
+    };
+    Page *Find(int level, int x, int y, bool &loaded); // the page's slot, or nullptr if every slot is in use
+    std::vector<Page> _pages;
+    unsigned _frame = 0;
+};
+
+void ColorPyramid::Resize(int width, int height, int levels)
+{
+    _levels.clear();
+    for (int i = 0; i < levels; i++)
+    {
+        Level level;
+        level.width = std::max((width + (1 << i) - 1) >> i, 1);
+        level.height = std::max((height + (1 << i) - 1) >> i, 1);
+        level.tilesX = (level.width + LOD_TILE - 1) / LOD_TILE;
+        level.tilesY = (level.height + LOD_TILE - 1) / LOD_TILE;
+        level.colors.assign(level.width * level.height, BLACK);
+        level.tileDirty.assign(level.tilesX * level.tilesY, 0);
+        _levels.push_back(level);
+    }
+}
+
+void ColorPyramid::MarkTiles(Level &level, int x0, int y0, int x1, int y1)
+{
+    level.changes++;
+    for (int ty = y0 / LOD_TILE; ty <= y1 / LOD_TILE; ty++)
+        for (int tx = x0 / LOD_TILE; tx <= x1 / LOD_TILE; tx++)
+            level.tileDirty[ty * level.tilesX + tx] = 1;
+}
+
+void ColorPyramid::Update(ParticleWorld &world, const std::vector<Rectangle> &damage)
+{
+    if (_levels.empty())
+        return;
+    Level &base = _levels[0];
+    for (const Rectangle &rect : damage)
+    {
+        int x0 = std::max((int)rect.x, 0);
+        int y0 = std::max((int)rect.y, 0);
+        int x1 = std::min((int)(rect.x + rect.width), base.width) - 1;
+        int y1 = std::min((int)(rect.y + rect.height), base.height) - 1;
+        if (x0 > x1 || y0 > y1)
+            continue;
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+                base.colors[y * base.width + x] = world.ParticleAtCoord(x, y)->getColor();
+        MarkTiles(base, x0, y0, x1, y1);
+        // each coarser texel is the mean of the up to four texels under it
+        for (int i = 1; i < (int)_levels.size(); i++)
+        {
+            Level &fine = _levels[i - 1];
+            Level &coarse = _levels[i];
+            x0 >>= 1;
+            y0 >>= 1;
+            x1 >>= 1;
+            y1 >>= 1;
+            for (int y = y0; y <= y1; y++)
+            {
+                for (int x = x0; x <= x1; x++)
+                {
+                    int r = 0, g = 0, b = 0, a = 0, n = 0;
+                    for (int fy = 2 * y; fy <= std::min(2 * y + 1, fine.height - 1); fy++)
+                    {
+                        for (int fx = 2 * x; fx <= std::min(2 * x + 1, fine.width - 1); fx++)
+                        {
+                            Color c = fine.colors[fy * fine.width + fx];
+                            r += c.r;
+                            g += c.g;
+                            b += c.b;
+                            a += c.a;
+                            n++;
+                        }
+                    }
+                    coarse.colors[y * coarse.width + x] = Color{(unsigned char)(r / n), (unsigned char)(g / n), (unsigned char)(b / n), (unsigned char)(a / n)};
+                }
+            }
+            MarkTiles(coarse, x0, y0, x1, y1);
+        }
+    }
+}
+
+int ColorPyramid::LevelForScale(float pixelsPerCell)
+{
+    int level = 0;
+    while (level + 1 < (int)_levels.size() && pixelsPerCell * (1 << (level + 1)) <= 1.0f)
+        level++;
+    return level;
+}
+
+void ColorPyramid::CopyRect(int level, Rectangle rect, std::vector<Color> &out)
+{
+    Level &l = _levels[level];
+    int x0 = (int)rect.x;
+    int y0 = (int)rect.y;
+    int w = (int)rect.width;
+    int h = (int)rect.height;
+    out.resize(w * h);
+    for (int y = 0; y < h; y++)
+        std::copy(&l.colors[(y0 + y) * l.width + x0], &l.colors[(y0 + y) * l.width + x0] + w, &out[y * w]);
+}
+
+void ColorPyramid::UploadPage(int level, int pageX, int pageY, Texture2D &texture, bool all)
+{
+    Level &l = _levels[level];
+    const int pageTiles = LOD_PAGE / LOD_TILE;
+    int tx0 = pageX * pageTiles;
+    int ty0 = pageY * pageTiles;
+    int tx1 = std::min(tx0 + pageTiles, l.tilesX);
+    int ty1 = std::min(ty0 + pageTiles, l.tilesY);
+    if (all)
+    {
+        int x = pageX * LOD_PAGE;
+        int y = pageY * LOD_PAGE;
+        Rectangle rect = {(float)x, (float)y, (float)std::min(LOD_PAGE, l.width - x), (float)std::min(LOD_PAGE, l.height - y)};
+        CopyRect(level, rect, _scratch);
+        UpdateTextureRec(texture, Rectangle{0.0f, 0.0f, rect.width, rect.height}, _scratch.data());
+        for (int ty = ty0; ty < ty1; ty++)
+            std::fill(&l.tileDirty[ty * l.tilesX + tx0], &l.tileDirty[ty * l.tilesX + tx1], 0);
+        return;
+    }
+    for (int ty = ty0; ty < ty1; ty++)
+    {
+        for (int tx = tx0; tx < tx1; tx++)
+        {
+            unsigned char &dirty = l.tileDirty[ty * l.tilesX + tx];
+            if (!dirty)
+                continue;
+            int x = tx * LOD_TILE;
+            int y = ty * LOD_TILE;
+            Rectangle rect = {(float)x, (float)y, (float)std::min(LOD_TILE, l.width - x), (float)std::min(LOD_TILE, l.height - y)};
+            CopyRect(level, rect, _scratch);
+            UpdateTextureRec(texture, Rectangle{(float)(x - pageX * LOD_PAGE), (float)(y - pageY * LOD_PAGE), rect.width, rect.height},
+                             _scratch.data());
+            dirty = 0;
+        }
+    }
+}
+
+void ColorPyramid::Sample(int level, int width, int height, std::vector<Color> &out)
+{
+    Level &l = _levels[level];
+    out.resize(width * height);
+    for (int y = 0; y < height; y++)
+    {
+        const Color *row = &l.colors[(size_t)y * l.height / height * l.width];
+        for (int x = 0; x < width; x++)
+            out[y * width + x] = row[(size_t)x * l.width / width];
+    }
+}
+
+void PyramidPages::Reserve(int screenWidth, int screenHeight)
+{
+    // LevelForScale keeps texels at least half a pixel wide, so a screen shows at most twice its size in
+    // texels per side, plus a page cut off at each edge
+    int across = 2 * screenWidth / LOD_PAGE + 3;
+    int down = 2 * screenHeight / LOD_PAGE + 3;
+    Unload();
+    _pages.resize(across * down);
+}
+
+PyramidPages::Page *PyramidPages::Find(int level, int x, int y, bool &loaded)
+{
+    Page *oldest = nullptr;
+    for (Page &page : _pages)
+    {
+        if (page.level == level && page.x == x && page.y == y)
+        {
+            loaded = false;
+            return &page;
+        }
+        if (page.drawn != _frame && (!oldest || page.drawn < oldest->drawn))
+            oldest = &page;
+    }
+    if (!oldest)
+        return nullptr;
+    if (oldest->texture.id == 0)
+    {
+        // created the first time the slot is used
+        Image image = GenImageColor(LOD_PAGE, LOD_PAGE, BLACK);
+        oldest->texture = LoadTextureFromImage(image);
+        UnloadImage(image);
+    }
+    oldest->level = level;
+    oldest->x = x;
+    oldest->y = y;
+    loaded = true;
+    return oldest;
+}
+
+void PyramidPages::Draw(ColorPyramid &pyramid, int level, Rectangle visible, float texelSize)
+{
+    _frame++;
+    int x0 = (int)visible.x;
+    int y0 = (int)visible.y;
+    int x1 = std::min((int)(visible.x + visible.width), pyramid.getLevelWidth(level));
+    int y1 = std::min((int)(visible.y + visible.height), pyramid.getLevelHeight(level));
+    for (int py = std::max(y0, 0) / LOD_PAGE; py * LOD_PAGE < y1; py++)
+    {
+        for (int px = std::max(x0, 0) / LOD_PAGE; px * LOD_PAGE < x1; px++)
+        {
+            bool loaded;
+            Page *page = Find(level, px, py, loaded);
+            if (!page)
+                continue; // more pages in view than Reserve allowed for
+            page->drawn = _frame;
+            pyramid.UploadPage(level, px, py, page->texture, loaded);
+            // only the part of the page in view
+            int sx0 = std::max(x0, px * LOD_PAGE);
+            int sy0 = std::max(y0, py * LOD_PAGE);
+            int sx1 = std::min(x1, (px + 1) * LOD_PAGE);
+            int sy1 = std::min(y1, (py + 1) * LOD_PAGE);
+            Rectangle source = {(float)(sx0 - px * LOD_PAGE), (float)(sy0 - py * LOD_PAGE), (float)(sx1 - sx0), (float)(sy1 - sy0)};
+            Rectangle dest = {sx0 * texelSize, sy0 * texelSize, (sx1 - sx0) * texelSize, (sy1 - sy0) * texelSize};
+            DrawTexturePro(page->texture, source, dest, Vector2{0.0f, 0.0f}, 0.0f, WHITE);
+        }
+    }
+}
+
+void PyramidPages::Unload()
+{
+    for (Page &page : _pages)
+        if (page.texture.id != 0)
+            UnloadTexture(page.texture);
+    _pages.clear();
+}
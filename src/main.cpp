@@ -1,34 +1,142 @@
 #include <raylib.h>
 #include <raymath.h>
+#include <cstring>
 #include <iostream>
 #include "particle.h"
+#include "scenarios.h"
+#include "snapshot.h"
+#include "undo.h"
+#include "domain.h"
+#include "lod.h"
+#include "viewer.h"
 using namespace std;
 
-int main()
+int main(int argc, char **argv)
 {
+    // --ranks N runs a scenario headless, split into strips across N processes; --headless publishes a
+    // scenario to shared memory and --viewer draws whatever is published there; --export also writes the
+    // headless frames to PNGs or stdout. --width and --height also size the world of the window
+    int ranks = 0;
+    bool headless = false;
+    bool viewer = false;
+    const char *shmName = VIEW_SHM_NAME;
+    int runWidth = 300;
+    int runHeight = 225;
+    int runSteps = 0;
+    unsigned runSeed = 1;
+    Scenario runScenario = scenario_sand_into_water;
+    bool exporting = false;
+    ExportFormat exportFormat = export_png;
+    std::string exportDir = ".";
+    int exportEvery = 1;
+    int exportScale = 1;
+    int exportThreads = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--ranks") && hasValue)
+            ranks = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--headless"))
+            headless = true;
+        else if (!strcmp(argv[i], "--viewer"))
+            viewer = true;
+        else if (!strcmp(argv[i], "--export") && hasValue)
+        {
+            bool known;
+            exportFormat = ExportFormatFromName(argv[++i], known);
+            if (!known)
+            {
+                std::fprintf(stderr, "unknown export format %s, use png or raw\n", argv[i]);
+                return 1;
+            }
+            exporting = true;
+        }
+        else if (!strcmp(argv[i], "--export-dir") && hasValue)
+            exportDir = argv[++i];
+        else if (!strcmp(argv[i], "--export-every") && hasValue)
+            exportEvery = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--export-scale") && hasValue)
+            exportScale = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--export-threads") && hasValue)
+            exportThreads = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--shm") && hasValue)
+            shmName = argv[++i];
+        else if (!strcmp(argv[i], "--width") && hasValue)
+            runWidth = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--height") && hasValue)
+            runHeight = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--steps") && hasValue)
+            runSteps = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && hasValue)
+            runSeed = (unsigned)std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--scenario") && hasValue && ScenarioFromName(argv[i + 1]) != scenario_count)
+            runScenario = ScenarioFromName(argv[++i]);
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--ranks N | --headless | --viewer] [--shm name] [--width N] [--height N] "
+                                 "[--steps N] [--seed N] [--scenario name] [--export png|raw] [--export-dir path] "
+                                 "[--export-every N] [--export-scale N] [--export-threads N]\n",
+                         argv[0]);
+            return 1;
+        }
+    }
+    if (ranks > 0 && exporting)
+    {
+        std::fprintf(stderr, "--export is not supported with --ranks\n");
+        return 1;
+    }
+    if (ranks > 0)
+        return RunStrips(ranks, runScenario, runWidth, runHeight, runSteps > 0 ? runSteps : 600, runSeed, 0.016);
+    if (headless || exporting)
+    {
+        FrameExporter exporter;
+        if (exporting && !exporter.Open(exportFormat, exportDir, exportEvery, exportScale, exportThreads))
+            return 1;
+        return RunHeadless(shmName, runScenario, runWidth, runHeight, runSteps, runSeed, 0.016, exporting ? &exporter : nullptr);
+    }
+
     cout << "Hello, World!" << endl;
     const int screenWidth = 1200;
     const int screenHeight = 900;
     const int pixelSize = 4;
-    const int virtualWidth = screenWidth / pixelSize;
-    const int virtualHeight = screenHeight / pixelSize;
-    const double virtualRatio = (double)virtualWidth / (double)screenHeight;
+    const int worldWidth = runWidth;
+    const int worldHeight = runHeight;
+    if (viewer)
+        return RunViewer(shmName, screenWidth, screenHeight);
     InitWindow(screenWidth, screenHeight, "Cellular Automata!");
 
+    // target is in cells and zoom is pixels per cell; the wheel zooms about the cursor, the middle button or
+    // the arrow keys pan and Home goes back to the start
     Camera2D worldSpaceCamera = {0};
-    worldSpaceCamera.zoom = 1.0f;
-
-    Camera2D screenSpaceCamera = {0};
-    screenSpaceCamera.zoom = 1.0f;
+    worldSpaceCamera.zoom = (float)pixelSize;
+    const float minZoom = 1.0f / 16.0f;
+    const float maxZoom = 32.0f;
+    const float panSpeed = 800.0f; // screen pixels per second
 
-    RenderTexture2D target = LoadRenderTexture(virtualWidth, virtualHeight);
-
-    Rectangle sourceRec = {0.0f, 0.0f, (double)target.texture.width, -(double)target.texture.height};
-    Rectangle destRec = {-virtualRatio, -virtualRatio, screenWidth + (virtualRatio * 2), screenHeight + (virtualRatio * 2)};
+    // the world is drawn from the pyramid level that fits the zoom, through pages of it that only hold
+    // what is in view; the overview is a small texture sampled from a coarse level whenever it changes
+    std::vector<Rectangle> damageRects;
+    ColorPyramid pyramid;
+    pyramid.Resize(worldWidth, worldHeight);
+    PyramidPages pages;
+    pages.Reserve(GetScreenWidth(), GetScreenHeight());
+    bool showOverview = false;
+    const int overviewSize = 240; // on its longer side
+    const float overviewScale = (float)overviewSize / std::max(worldWidth, worldHeight);
+    const int overviewWidth = std::max((int)(worldWidth * overviewScale), 1);
+    const int overviewHeight = std::max((int)(worldHeight * overviewScale), 1);
+    Texture2D overviewTexture = {0};
+    std::vector<Color> overviewColors;
+    unsigned overviewChanges = 0;
+    bool throttleFar = false; // chunks away from the view update every farInterval-th step
+    const int farInterval = 4;
 
     Vector2 origin = {0.0f, 0.0f};
 
-    ParticleWorld particleWorld(virtualWidth, virtualHeight);
+    ParticleWorld particleWorld(worldWidth, worldHeight);
+    FrameProfiler profiler;
+    particleWorld.setProfiler(&profiler);
+    particleWorld.MarkAllDirty();
 
     double previousTime = GetTime();
     int targetFPS = -10;
@@ -38,53 +146,58 @@ int main()
     double waitTime = 0.0;
 
     Mat_Type drawType = t_sand;
+    const int brushRadius = 25;
+    const double brushDensity = 0.05;
+    int lastBrushX = 0;
+    int lastBrushY = 0;
+    bool wasClicking = false;
+    const float heatPerFrame = 40.0f;
+    bool showHeat = false;
+    SnapshotWriter snapshotWriter;
+    UndoHistory history; // brush strokes, scenario loads and snapshot loads
+    const char *snapshotPath = "snapshot.bin";
 
     while (!WindowShouldClose())
     {
+        profiler.BeginFrame();
+        TRACE_SCOPE("frame");
         int mouseX = GetMouseX();
         int mouseY = GetMouseY();
-        int virtualMouseX = mouseX / pixelSize;
-        int virtualMouseY = mouseY / pixelSize;
+        Vector2 mouseWorld = GetScreenToWorld2D(Vector2{(float)mouseX, (float)mouseY}, worldSpaceCamera);
+        int virtualMouseX = (int)std::floor(mouseWorld.x);
+        int virtualMouseY = (int)std::floor(mouseWorld.y);
         bool click = IsMouseButtonDown(0);
+        bool heat = IsMouseButtonDown(1);
 
         particleWorld.setDeltaTime(deltaTime);
         particleWorld.setCurrentTime(GetTime());
 
+        ScopedTimer brushTimer(&profiler, phase_brush);
         if (click)
         {
-            for (int i = 0; i < 100; i++)
+            // stroke from last frame's position so fast drags leave no gaps
+            if (!wasClicking)
             {
-                int r = 50;
-                int xO = rand() % r - ( r / 2);
-                int yO = rand() % r - ( r / 2);
-                Color drawColor = WHITE;
-                switch (drawType)
-                {
-                case t_air:
-                {
-                    drawColor = color_air();
-                    break;
-                }
-                case t_sand:
-                {
-                    drawColor = color_sand();
-                    break;
-                }
-                case t_solid:
-                {
-                    drawColor = color_solid();
-                    break;
-                }
-                case t_water:
-                {
-                    drawColor = color_water();
-                    break;
-                }
-                }
-                Particle *nP = new Particle{drawType, drawColor};
-                particleWorld.SetParticle(Vector2{(float)virtualMouseX + xO, (float)virtualMouseY + yO}, nP);
+                lastBrushX = virtualMouseX;
+                lastBrushY = virtualMouseY;
+                history.BeginEdit(particleWorld);
             }
+            history.Attach(particleWorld);
+            particleWorld.Stroke(lastBrushX, lastBrushY, virtualMouseX, virtualMouseY, brushRadius, drawType, brushDensity);
+            history.Detach(particleWorld);
+            lastBrushX = virtualMouseX;
+            lastBrushY = virtualMouseY;
         }
+        else if (wasClicking)
+            history.EndEdit();
+        wasClicking = click;
+        if (heat)
+        {
+            // shift cools instead of heating
+            float amount = IsKeyDown(KEY_LEFT_SHIFT) ? -heatPerFrame : heatPerFrame;
+            particleWorld.AddHeat(virtualMouseX, virtualMouseY, brushRadius / 2, amount);
+        }
+        brushTimer.Stop();
         if (IsKeyPressed(KEY_A))
         {
             drawType = t_air;
@@ -101,40 +214,237 @@ int main()
         {
             drawType = t_water;
         }
-        particleWorld.UpdateParticles();
-        BeginTextureMode(target);
+        if (IsKeyPressed(KEY_G))
         {
-            ClearBackground(WHITE);
-            BeginMode2D(worldSpaceCamera);
+            drawType = t_glass;
+        }
+        if (IsKeyPressed(KEY_V))
+        {
+            drawType = t_steam;
+        }
+        if (IsKeyPressed(KEY_F))
+        {
+            drawType = t_fire;
+        }
+        if (IsKeyPressed(KEY_T))
+        {
+            drawType = t_wood;
+        }
+        for (int i = 0; i < scenario_count; i++)
+        {
+            if (IsKeyPressed(KEY_ONE + i))
             {
-                for (int i = 0; i < virtualWidth * virtualHeight; i++)
-                {
-                    Particle *p = particleWorld.ParticleAtIndex(i);
-                    if (p->getType() == t_air)
-                        continue;
-                    Vector2 v = particleWorld.IndexToCoord(i);
-                    int x = v.x;
-                    int y = v.y;
-                    DrawPixel(x, y, p->getColor());
-                }
+                history.BeginEdit(particleWorld);
+                history.Attach(particleWorld);
+                BuildScenario(particleWorld, (Scenario)i, worldWidth, worldHeight);
+                history.Detach(particleWorld);
+                history.EndEdit();
             }
-            EndMode2D();
         }
-        EndTextureMode();
+        if (IsKeyPressed(KEY_E))
+        {
+            particleWorld.setWaterEqualization(!particleWorld.getWaterEqualization());
+        }
+        if (IsKeyPressed(KEY_P))
+        {
+            particleWorld.setPressureEnabled(!particleWorld.getPressureEnabled());
+        }
+        if (IsKeyPressed(KEY_R))
+        {
+            // drop a crate at the cursor
+            particleWorld.AddBody(BoxShape(randomBetween(8.0, 24.0), randomBetween(8.0, 16.0)), Vector2{(float)virtualMouseX, (float)virtualMouseY},
+                                  randomBetween(0.0, PI), Vector2{0.0f, 0.0f}, randomBetween(-0.05, 0.05));
+        }
+        if (IsKeyPressed(KEY_X))
+        {
+            // explosion at the cursor
+            particleWorld.ApplyImpulse(virtualMouseX, virtualMouseY, brushRadius, 30.0f);
+            particleWorld.AddHeat(virtualMouseX, virtualMouseY, brushRadius / 3, 800.0f);
+        }
+        if (IsKeyPressed(KEY_H))
+        {
+            showHeat = !showHeat;
+        }
+        if (IsKeyPressed(KEY_M))
+        {
+            showOverview = !showOverview;
+        }
+        if (IsKeyPressed(KEY_L))
+        {
+            throttleFar = !throttleFar;
+        }
+        float wheel = GetMouseWheelMove();
+        if (wheel != 0.0f)
+        {
+            // keep the cell under the cursor in place
+            worldSpaceCamera.offset = Vector2{(float)mouseX, (float)mouseY};
+            worldSpaceCamera.target = mouseWorld;
+            worldSpaceCamera.zoom = Clamp(worldSpaceCamera.zoom * std::pow(1.25f, wheel), minZoom, maxZoom);
+        }
+        if (IsMouseButtonDown(MOUSE_BUTTON_MIDDLE))
+        {
+            worldSpaceCamera.target = Vector2Subtract(worldSpaceCamera.target, Vector2Scale(GetMouseDelta(), 1.0f / worldSpaceCamera.zoom));
+        }
+        Vector2 pan = {(float)(IsKeyDown(KEY_RIGHT) - IsKeyDown(KEY_LEFT)), (float)(IsKeyDown(KEY_DOWN) - IsKeyDown(KEY_UP))};
+        worldSpaceCamera.target = Vector2Add(worldSpaceCamera.target, Vector2Scale(pan, panSpeed * deltaTime / worldSpaceCamera.zoom));
+        if (IsKeyPressed(KEY_HOME))
+        {
+            worldSpaceCamera.offset = Vector2{0.0f, 0.0f};
+            worldSpaceCamera.target = Vector2{0.0f, 0.0f};
+            worldSpaceCamera.zoom = (float)pixelSize;
+        }
+        // cells in view, clipped to the world
+        Vector2 viewMin = GetScreenToWorld2D(Vector2{0.0f, 0.0f}, worldSpaceCamera);
+        Vector2 viewMax = GetScreenToWorld2D(Vector2{(float)GetScreenWidth(), (float)GetScreenHeight()}, worldSpaceCamera);
+        int viewX0 = std::max((int)std::floor(viewMin.x), 0);
+        int viewY0 = std::max((int)std::floor(viewMin.y), 0);
+        int viewX1 = std::min((int)std::ceil(viewMax.x), worldWidth);
+        int viewY1 = std::min((int)std::ceil(viewMax.y), worldHeight);
+        Rectangle view = {(float)viewX0, (float)viewY0, (float)std::max(viewX1 - viewX0, 0), (float)std::max(viewY1 - viewY0, 0)};
+        particleWorld.setFocus(view, throttleFar ? farInterval : 1);
+        if (IsKeyPressed(KEY_F1))
+        {
+            profiler.setOverlayVisible(!profiler.isOverlayVisible());
+        }
+        if (IsKeyPressed(KEY_F2))
+        {
+            if (profiler.isRecording())
+                profiler.StopCsv();
+            else
+                profiler.StartCsv("frame_profile.csv");
+        }
+        if (IsKeyPressed(KEY_F3))
+        {
+            if (TraceWriter::Get().isEnabled())
+                TraceWriter::Get().End();
+            else
+                TraceWriter::Get().Begin("trace.json");
+        }
+        if (IsKeyPressed(KEY_F5))
+        {
+            // saved in the background while the simulation keeps running
+            snapshotWriter.Begin(particleWorld, snapshotPath);
+        }
+        if (IsKeyPressed(KEY_F9))
+        {
+            snapshotWriter.Wait();
+            history.BeginEdit(particleWorld);
+            history.Attach(particleWorld);
+            if (!LoadSnapshot(particleWorld, snapshotPath))
+                cout << "could not load " << snapshotPath << endl;
+            history.Detach(particleWorld);
+            history.EndEdit();
+        }
+        if (IsKeyPressed(KEY_Z) && (IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL)))
+        {
+            // ctrl+shift+z redoes
+            if (IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT))
+                history.Redo(particleWorld);
+            else
+                history.Undo(particleWorld);
+        }
+        if (IsKeyPressed(KEY_Y) && (IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL)))
+        {
+            history.Redo(particleWorld);
+        }
+        if (snapshotWriter.Poll())
+            cout << (snapshotWriter.getSucceeded() ? "saved " : "failed to save ") << snapshotPath << " in " << snapshotWriter.getSaveMs()
+                 << " ms, " << snapshotWriter.getCopiedChunks() << " chunks copied on write" << endl;
+        particleWorld.UpdateParticles();
+        ScopedTimer drawTimer(&profiler, phase_draw);
+        particleWorld.CollectDamageRects(damageRects);
+        pyramid.Update(particleWorld, damageRects);
+        int level = pyramid.LevelForScale(worldSpaceCamera.zoom);
+        int levelScale = 1 << level;
+        Rectangle levelView = {(float)(viewX0 / levelScale), (float)(viewY0 / levelScale), 0.0f, 0.0f};
+        levelView.width = std::max((viewX1 + levelScale - 1) / levelScale - (int)levelView.x, 0);
+        levelView.height = std::max((viewY1 + levelScale - 1) / levelScale - (int)levelView.y, 0);
 
         BeginDrawing();
         {
             ClearBackground(RED);
-            BeginMode2D(screenSpaceCamera);
+            BeginMode2D(worldSpaceCamera);
             {
-                DrawTexturePro(target.texture, sourceRec, destRec, origin, 0.0f, WHITE);
+                pages.Draw(pyramid, level, levelView, (float)levelScale);
+                // particles in flight are not part of the world texture
+                FlyingParticles &flying = particleWorld.getFlying();
+                for (int i = 0; i < flying.size(); i++)
+                {
+                    int x = (int)flying.getX(i);
+                    int y = (int)flying.getY(i);
+                    if (x >= viewX0 && x < viewX1 && y >= viewY0 && y < viewY1)
+                        DrawRectangle(x, y, 1, 1, flying.getColor(i));
+                }
+                if (showHeat && !particleWorld.getThermal().isIdle())
+                {
+                    // one translucent square per thermal cell in view that is noticeably off ambient
+                    ThermalField &thermal = particleWorld.getThermal();
+                    int scale = thermal.getScale();
+                    for (int cy = viewY0 / scale; cy < std::min((viewY1 + scale - 1) / scale, thermal.getCoarseHeight()); cy++)
+                    {
+                        for (int cx = viewX0 / scale; cx < std::min((viewX1 + scale - 1) / scale, thermal.getCoarseWidth()); cx++)
+                        {
+                            float t = thermal.CellTemperature(cx, cy) - THERMAL_AMBIENT;
+                            if (std::abs(t) < 5.0f)
+                                continue;
+                            float alpha = std::min(std::abs(t) / 1000.0f, 1.0f) * 0.7f;
+                            DrawRectangle(cx * scale, cy * scale, scale, scale, Fade(t > 0.0f ? ORANGE : SKYBLUE, alpha));
+                        }
+                    }
+                }
             }
             EndMode2D();
+            if (showOverview)
+            {
+                // the whole world in a corner, sampled from the coarsest level that still fills it, and the part in view
+                float scale = overviewScale;
+                int overviewLevel = pyramid.LevelForScale(scale);
+                if (overviewTexture.id == 0)
+                {
+                    Image image = GenImageColor(overviewWidth, overviewHeight, BLACK);
+                    overviewTexture = LoadTextureFromImage(image);
+                    UnloadImage(image);
+                    overviewChanges = pyramid.getChanges(overviewLevel) - 1; // sampled right below
+                }
+                if (pyramid.getChanges(overviewLevel) != overviewChanges)
+                {
+                    overviewChanges = pyramid.getChanges(overviewLevel);
+                    pyramid.Sample(overviewLevel, overviewWidth, overviewHeight, overviewColors);
+                    UpdateTexture(overviewTexture, overviewColors.data());
+                }
+                Rectangle dest = {(float)(GetScreenWidth() - overviewWidth - 10), 140.0f, (float)overviewWidth, (float)overviewHeight};
+                DrawTexturePro(overviewTexture, Rectangle{0.0f, 0.0f, (float)overviewWidth, (float)overviewHeight}, dest, origin, 0.0f, WHITE);
+                DrawRectangleLinesEx(dest, 1.0f, LIME);
+                DrawRectangleLinesEx(Rectangle{dest.x + view.x * scale, dest.y + view.y * scale, view.width * scale, view.height * scale}, 1.0f, YELLOW);
+            }
+            drawTimer.Stop();
 
             DrawFPS(GetScreenWidth() - 95, 10);
             DrawText(TextFormat("deltatime: %f", deltaTime), GetScreenWidth() - 220, 70, 20, LIME);
+            if (snapshotWriter.isSaving())
+                DrawText("saving...", GetScreenWidth() - 220, 95, 20, LIME);
+            DrawText(TextFormat("undo %d  redo %d  %.1f MB", history.getUndoCount(), history.getRedoCount(), history.getBytes() / 1048576.0),
+                     GetScreenWidth() - 220, 120, 10, LIME);
+            profiler.DrawOverlay(10, 10);
+            if (profiler.isOverlayVisible())
+            {
+                SimStats const &stats = particleWorld.getStats();
+                DrawText(TextFormat("scanned %ld  proposed %ld  swapped %ld", stats.scanned, stats.proposed, stats.swapsApplied), 10, 190, 10, LIME);
+                DrawText(TextFormat("rejected %ld  contention %ld  active chunks %d/%d  equalized %ld  flying %d  skipped %d", stats.rejectedOccupied,
+                                    stats.contentionLosers, stats.activeChunks, particleWorld.getChunksX() * particleWorld.getChunksY(),
+                                    stats.equalized, stats.flying, stats.skippedChunks),
+                         10, 206, 10, LIME);
+                DrawText(TextFormat("air %ld  solid %ld  sand %ld  water %ld  glass %ld  steam %ld  fire %ld  wood %ld  transitions %ld",
+                                    stats.materialCounts[t_air], stats.materialCounts[t_solid], stats.materialCounts[t_sand],
+                                    stats.materialCounts[t_water], stats.materialCounts[t_glass], stats.materialCounts[t_steam],
+                                    stats.materialCounts[t_fire], stats.materialCounts[t_wood], stats.transitions),
+                         10, 222, 10, LIME);
+            }
         }
+        ScopedTimer presentTimer(&profiler, phase_present);
         EndDrawing();
+        presentTimer.Stop();
+        profiler.EndFrame();
 
         currentTime = GetTime();
         updateDrawTime = currentTime - previousTime;
@@ -153,7 +463,10 @@ int main()
         previousTime = currentTime;
     }
 
-    UnloadRenderTexture(target);
+    TraceWriter::Get().End();
+    pages.Unload();
+    if (overviewTexture.id != 0)
+        UnloadTexture(overviewTexture);
 
     CloseWindow();
 
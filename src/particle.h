@@ -1,7 +1,17 @@
+#pragma once
 #include <raylib.h>
 #include <iostream>
 #include <algorithm>
+#include <cmath>
 #include <vector>
+#include "cow.h"
+#include "pressure.h"
+#include "flying.h"
+#include "hugepage.h"
+#include "profiler.h"
+#include "rigidbody.h"
+#include "thermal.h"
+#include "trace.h"
 
 double randomBetween(double a, double b);
 
@@ -10,13 +20,136 @@ typedef int Mat_Type;
 #define t_solid (Mat_Type)1
 #define t_sand (Mat_Type)2
 #define t_water (Mat_Type)3
+#define t_glass (Mat_Type)4
+#define t_steam (Mat_Type)5
+#define t_fire (Mat_Type)6
+#define t_wood (Mat_Type)7
+#define t_body (Mat_Type)8 // cell covered by a rigid body
+#define MAT_COUNT 9
+#define MAT_MASK(t) (1u << (t))
+// cells falling sand can travel through; the free-run cache is kept for this mask
+#define PASS_FALL (MAT_MASK(t_air) | MAT_MASK(t_water) | MAT_MASK(t_steam) | MAT_MASK(t_fire))
 
 #define color_air() WHITE
 #define color_solid() ColorBrightness(BLACK, randomBetween(-.1f, .3f))
 #define color_sand() ColorBrightness(YELLOW, randomBetween(-.5f, 0.0f))
 #define color_water() ColorBrightness(BLUE, randomBetween(-0.2f, .2f))
+#define color_glass() ColorBrightness(SKYBLUE, randomBetween(0.3f, .6f))
+#define color_steam() ColorBrightness(LIGHTGRAY, randomBetween(0.0f, .3f))
+#define color_fire() ColorBrightness(ORANGE, randomBetween(-0.3f, .2f))
+#define color_wood() ColorBrightness(BROWN, randomBetween(-0.2f, .1f))
+#define color_body() GRAY
+
+// how a material moves; everything from move_powder on is handled by UpdateMovable
+enum MoveKind
+{
+    move_empty = 0, // does not move, but anything may displace it
+    move_static,    // never moves and is never displaced
+    move_powder,    // falls and slides down diagonals
+    move_liquid,    // falls and spreads sideways
+    move_gas,       // rises and spreads sideways
+};
+
+// behaviour of each material, indexed by Mat_Type
+struct MaterialInfo
+{
+    const char *name;
+    MoveKind move;
+    float density;        // movers swap with lighter cells below them, gases with denser cells above
+    float maxSpeed;       // cells per step, 0 for unlimited
+    float dispersion;     // chance per step of drifting diagonally instead of moving straight
+    float conductivity;   // share of the neighbour difference exchanged per step, at most 0.24
+    float transitionTemp; // the cell turns into transitionTo at or above this temperature, 0 for never
+    Mat_Type transitionTo;
+    float latentHeat; // degrees taken from the cell by the transition
+    int lifetime;     // average steps before the cell turns into decayTo, 0 for forever
+    Mat_Type decayTo;
+    float heatOutput; // degrees added to the cell's temperature every step
+};
+
+static const MaterialInfo materialInfo[MAT_COUNT] = {
+    {"air", move_empty, 1.2f, 0.0f, 0.0f, 0.02f, 0.0f, t_air, 0.0f, 0, t_air, 0.0f},
+    {"solid", move_static, 5000.0f, 0.0f, 0.0f, 0.20f, 0.0f, t_solid, 0.0f, 0, t_solid, 0.0f},
+    {"sand", move_powder, 1600.0f, 0.0f, 0.0f, 0.08f, 1200.0f, t_glass, 200.0f, 0, t_sand, 0.0f},
+    {"water", move_liquid, 1000.0f, 0.0f, 0.0f, 0.12f, 100.0f, t_steam, 60.0f, 0, t_water, 0.0f},
+    {"glass", move_static, 2500.0f, 0.0f, 0.0f, 0.10f, 0.0f, t_glass, 0.0f, 0, t_glass, 0.0f},
+    {"steam", move_gas, 0.6f, 2.0f, 0.3f, 0.03f, 0.0f, t_steam, 0.0f, 400, t_water, 0.0f}, // condenses back into water
+    {"fire", move_gas, 0.3f, 2.0f, 0.5f, 0.05f, 0.0f, t_fire, 0.0f, 40, t_air, 30.0f},
+    {"wood", move_static, 700.0f, 0.0f, 0.0f, 0.03f, 300.0f, t_fire, 0.0f, 0, t_wood, 0.0f}, // fire spreads by heating it
+    {"body", move_static, 5000.0f, 0.0f, 0.0f, 0.10f, 0.0f, t_body, 0.0f, 0, t_body, 0.0f},
+};
 
 #define GRAVITY 9.80f
+#define TRACE_BAND_ROWS 32 // rows per "scan rows" trace event
+#define CHUNK_SIZE 32      // side length of the square chunks the world is tracked in
+#define CHUNK_CELLS (CHUNK_SIZE * CHUNK_SIZE)
+
+// Cells are stored row by row across the whole world by default, so the cell below is a full row away.
+// Define GRID_TILED to store them chunk by chunk instead: vertical neighbours are then CHUNK_SIZE cells
+// apart and a chunk is one contiguous block, which keeps falls and rises in wide worlds within a few
+// cache lines and pages. Inside a chunk the rows go bottom to top, so the scan, which runs upwards,
+// still walks memory forwards. Either way, per-cell arrays are only indexed through CellIndex and its
+// neighbours. The tiled scan visits cells in another order, so random draws and decay during the scan
+// fall on other cells: the two layouts behave the same statistically but do not give identical worlds.
+#ifdef GRID_TILED
+static_assert((CHUNK_SIZE & (CHUNK_SIZE - 1)) == 0, "GRID_TILED needs a power-of-two CHUNK_SIZE");
+#endif
+
+// a horizontal run of water cells in one row, used by the level-equalization pass
+struct WaterRun
+{
+    int y;
+    int x0;
+    int x1; // inclusive
+};
+
+// a cell taking part in level equalization, tagged with the water body it belongs to
+struct EqualizeCell
+{
+    int body;
+    int y;
+    int idx;
+};
+
+// a particle handed to the process owning the rows it moved into. The sender already swapped it with
+// the halo copy of the cell it entered, so the receiver has to take in the mover and give up one
+// particle of the displaced type.
+struct Migration
+{
+    int x;
+    int y;
+    int fromX;
+    int fromY;
+    unsigned char type;
+    unsigned char displaced;
+    bool bounced; // sent back to where it came from because the receiver had no room
+    Color color;
+    Vector2 velocity;
+    int life;
+    bool flying = false; // still in flight, it goes on flying in the receiver
+};
+
+// counters for the most recent UpdateParticles call
+struct SimStats
+{
+    long scanned = 0;            // cells dispatched to a material kernel
+    long proposed = 0;           // moves queued by the material kernels
+    long rejectedOccupied = 0;   // moves dropped because the destination was no longer free
+    long contentionLosers = 0;   // moves dropped because another move won the same destination
+    long swapsApplied = 0;       // moves actually committed
+    int activeChunks = 0;        // chunks with at least one proposed move
+    long equalized = 0;          // water cells moved by the level-equalization pass
+    long transitions = 0;        // cells that changed material because of their temperature
+    long bodyCells = 0;          // cells written or cleared while moving rigid bodies
+    long ejected = 0;            // particles that left the grid to fly freely
+    long landed = 0;             // flying particles put back into the grid
+    long unlanded = 0;           // flying particles that found no air to land in and stay in flight
+    int flying = 0;              // particles in flight after the step
+    long migrated = 0;           // moves out of the owned rows, handed over through the outbox
+    int skippedChunks = 0;       // chunks outside the focus that sat this step out
+    long materialCounts[MAT_COUNT] = {0}; // of the scanned cells, so skipped chunks are missing
+
+};
 
 class Particle
 {
@@ -44,6 +177,8 @@ public:
     Color const getColor() { return _color; };
     void setColor(Color col) { _color = col; };
     Mat_Type const getType() { return _materialType; };
+    int const getLife() { return _life; };
+    void setLife(int life) { _life = life; };
 
 private:
     Vector2 _position = {0, 0};
@@ -52,8 +187,11 @@ private:
     Color _color = BLACK;
     bool _hasBeenUpdated = false;
     Mat_Type _materialType = t_air;
+    int _life = 0; // steps left for materials with a lifetime
 };
 
+Particle *MakeParticle(Mat_Type type); // new particle of the given material with its randomized color
+
 class ParticleWorld
 {
 public:
@@ -65,67 +203,296 @@ public:
     Particle *ParticleAtIndex(int idx);
     void SetParticle(int x, int y, Particle *particle); // sets particle at x y position to this particle
     void SetParticle(Vector2 v, Particle *particle);    // sets particle at x y position to this particle
+    // bulk painting; cells are replaced with probability density, bounds are inclusive and clipped to the world
+    void FillRect(int x0, int y0, int x1, int y1, Mat_Type type, double density = 1.0);
+    void FillCircle(int cx, int cy, int radius, Mat_Type type, double density = 1.0);
+    void Stroke(int x0, int y0, int x1, int y1, int radius, Mat_Type type, double density = 1.0); // capsule between two points
     int CoordToIndex(int x, int y);
     int CoordToIndex(Vector2 v);
     Vector2 IndexToCoord(int idx);
     double const getDeltaTime() { return _deltaTime; };
     void setDeltaTime(double dt) { _deltaTime = dt; };
     void setCurrentTime(double t) { _currentTime = t; };
+    void setProfiler(FrameProfiler *profiler) { _profiler = profiler; };
+    bool const getWaterEqualization() { return _equalizeWater; };
+    void setWaterEqualization(bool enabled) { _equalizeWater = enabled; };
+    // chunks away from focus (in cells) only update every farInterval-th step, staggered so the work is
+    // spread over the steps; an interval of 1 updates everything
+    void setFocus(Rectangle focus, int farInterval);
+    int const getFarInterval() { return _farInterval; };
+    bool const getPressureEnabled() { return _pressureEnabled; };
+    void setPressureEnabled(bool enabled) { _pressureEnabled = enabled; };
+    void setPressureIterations(int iterations) { _pressureIterations = iterations; };
+    PressureField &getPressure() { return _pressure; };
+    bool const getThermalEnabled() { return _thermalEnabled; };
+    void setThermalEnabled(bool enabled) { _thermalEnabled = enabled; };
+    void setThermalScale(int scale) { _thermal.Resize(_width, _height, scale); }; // resets all temperatures
+    ThermalField &getThermal() { return _thermal; };
+    void AddHeat(int x, int y, int radius, float amount) { _thermal.AddHeat(x, y, radius, amount, _ownedTop, _ownedBottom); };
+    // adds a convex polygon (vertices around its centre, in cells) and writes it into the grid;
+    // returns its index, or -1 if the spot is blocked
+    int AddBody(const std::vector<Vector2> &shape, Vector2 position, float angle = 0.0f, Vector2 velocity = {0, 0}, float angularVelocity = 0.0f);
+    void ClearBodies() { _bodies.clear(); }; // forgets all bodies, leaving their cells in the grid
+    std::vector<RigidBody> &getBodies() { return _bodies; };
+    FlyingParticles &getFlying() { return _flying; };
+    // only rows top..bottom are simulated; moves leaving them go to the outbox instead of being applied,
+    // and FillRect, AddHeat and ApplyImpulse leave the other rows alone
+    void setOwnedRows(int top, int bottom);
+    int const getOwnedTop() { return _ownedTop; };
+    int const getOwnedBottom() { return _ownedBottom; };
+    std::vector<Migration> &getOutbox() { return _outbox; };
+    bool ReceiveMigration(const Migration &m); // false if the column holds nothing of the displaced type
+    // puts a particle in the nearest cell of column x to y, within the owned rows, whose type is in the
+    // into mask; false if there is none
+    bool PlaceParticle(int x, int y, unsigned into, Mat_Type type, Color color, int life, Vector2 velocity);
+    void ReadRow(int y, unsigned char *types, Color *colors);
+    void WriteRow(int y, const unsigned char *types, const Color *colors);
+    // pushes powders, liquids and bodies within radius away from (x, y), strength in cells per step at the
+    // centre falling off linearly to 0 at the edge; returns the number of grid particles affected
+    long ApplyImpulse(int x, int y, int radius, float strength);
+    void ClearFlying() { _flying.Clear(); };
+    SimStats const &getStats() { return _stats; };
+    int const getWidth() { return _width; };
+    int const getHeight() { return _height; };
+    int const getChunksX() { return _chunksX; };
+    int const getChunksY() { return _chunksY; };
+    int ChunkIndex(int x, int y) { return (y / CHUNK_SIZE) * _chunksX + (x / CHUNK_SIZE); }
+    Rectangle ChunkBounds(int chunk); // cell rectangle covered by a chunk, clipped to the world
+    void MarkDirty(int x, int y);
+    void MarkDirty(int idx);
+    void MarkChunkDirty(int chunk);
+    void MarkAllDirty();
+    std::vector<int> const &getDamagedChunks() { return _damagedChunks; };
+    void CollectDamageRects(std::vector<Rectangle> &rects); // merges dirty chunks into row runs and clears the damage
+    void CaptureChunk(int chunk, ChunkImage &image);          // only reads, so it may run on another thread
+    void RestoreChunk(const ChunkImage &image);
+    // while attached, the first write to each chunk copies it into the epoch first
+    void AttachEpoch(CowEpoch *epoch) { _epochs.push_back(epoch); };
+    void DetachEpoch(CowEpoch *epoch) { _epochs.erase(std::remove(_epochs.begin(), _epochs.end(), epoch), _epochs.end()); };
 
 protected:
     bool InBounds(int x, int y) { return x >= 0 && y >= 0 && x < _width && y < _height; }
-    bool IsEmpty(Particle *p) { return p != nullptr && p->getType() == t_air; }
-    bool IsEmpty(int x, int y)
+    // position of a cell in the per-cell arrays and back; the cell must be in the world
+    int CellIndex(int x, int y)
     {
-        Particle *p = ParticleAtCoord(x, y);
-        return IsEmpty(p);
+#ifdef GRID_TILED
+        return (((unsigned)y / CHUNK_SIZE) * _chunksX + (unsigned)x / CHUNK_SIZE) * CHUNK_CELLS +
+               (CHUNK_SIZE - 1 - (unsigned)y % CHUNK_SIZE) * CHUNK_SIZE + (unsigned)x % CHUNK_SIZE;
+#else
+        return y * _width + x;
+#endif
     }
-    bool IsEmptyOrWater(int x, int y)
+    int CellX(int idx)
     {
-        Particle *p = ParticleAtCoord(x, y);
-        return IsEmptyOrWater(p);
+#ifdef GRID_TILED
+        return ((unsigned)idx / CHUNK_CELLS) % _chunksX * CHUNK_SIZE + (unsigned)idx % CHUNK_SIZE;
+#else
+        return idx % _width;
+#endif
     }
-    bool IsEmptyOrWater(Particle *p)
+    int CellY(int idx)
     {
-        return (p != nullptr && (p->getType() == t_water || p->getType() == t_air));
+#ifdef GRID_TILED
+        return ((unsigned)idx / CHUNK_CELLS) / _chunksX * CHUNK_SIZE + CHUNK_SIZE - 1 - (unsigned)idx % CHUNK_CELLS / CHUNK_SIZE;
+#else
+        return idx / _width;
+#endif
     }
-    bool IsWater(int x, int y)
+    int ChunkOfCell(int idx)
     {
-
-        Particle *p = ParticleAtCoord(x, y);
-        return IsWater(p);
+#ifdef GRID_TILED
+        return (unsigned)idx / CHUNK_CELLS;
+#else
+        return ChunkIndex(idx % _width, idx / _width);
+#endif
+    }
+    // the cells right below and above idx, which is in row y; the neighbour must be in the world
+    int CellBelow(int idx, int y)
+    {
+#ifdef GRID_TILED
+        return (y + 1) % CHUNK_SIZE ? idx - CHUNK_SIZE : idx + _chunksX * CHUNK_CELLS + (CHUNK_SIZE - 1) * CHUNK_SIZE;
+#else
+        return idx + _width;
+#endif
+    }
+    int CellAbove(int idx, int y)
+    {
+#ifdef GRID_TILED
+        return y % CHUNK_SIZE ? idx + CHUNK_SIZE : idx - _chunksX * CHUNK_CELLS - (CHUNK_SIZE - 1) * CHUNK_SIZE;
+#else
+        return idx - _width;
+#endif
+    }
+    // the cells left and right of idx, which is in column x; the neighbour must be in the world
+    int CellLeft(int idx, int x)
+    {
+#ifdef GRID_TILED
+        return x % CHUNK_SIZE ? idx - 1 : idx - CHUNK_CELLS + CHUNK_SIZE - 1;
+#else
+        return idx - 1;
+#endif
     }
+    int CellRight(int idx, int x)
+    {
+#ifdef GRID_TILED
+        return (x + 1) % CHUNK_SIZE ? idx + 1 : idx + CHUNK_CELLS - CHUNK_SIZE + 1;
+#else
+        return idx + 1;
+#endif
+    }
+    const unsigned char *RowMajorTypes(); // _cellTypes row by row across the world, for the coarse fields
+    bool IsEmpty(Particle *p) { return p != nullptr && p->getType() == t_air; }
+    bool IsEmpty(int x, int y) { return InBounds(x, y) && _cellTypes[CellIndex(x, y)] == t_air; }
+    bool IsEmptyOrWater(int x, int y) { return Passable(x, y, MAT_MASK(t_air) | MAT_MASK(t_water)); }
+    bool IsEmptyOrWater(Particle *p)
+    {
+        return (p != nullptr && (p->getType() == t_water || p->getType() == t_air));
+    }
+    bool IsWater(int x, int y) { return InBounds(x, y) && _cellTypes[CellIndex(x, y)] == t_water; }
+    bool Passable(int x, int y, unsigned mask) { return InBounds(x, y) && (mask & MAT_MASK(_cellTypes[CellIndex(x, y)])); }
     bool IsWater(Particle *p)
     {
         return (p != nullptr && p->getType() == t_water);
     }
     void SwapParticles(int x1, int y1, int x2, int y2);
     void SwapParticles(int id1, int id2);
-    void UpdateSand(int x, int y);
-    void UpdateWater(int x, int y);
+    void UpdateMovable(int x, int y); // density-driven movement for powders, liquids and gases
     void CommitChanges();
     void MoveParticle(int x1, int y1, int x2, int y2);
+    void DiscardMoves() { _frameSwaps.clear(); } // drops queued moves without applying them
+    void TraceMove(int x, int y, int dx, int dy, unsigned mask, int &outX, int &outY);
+    void SetCellType(int idx, Mat_Type type);
+    void BeforeWrite(int idx)
+    {
+        if (!_epochs.empty())
+            CopyChunkOnWrite(ChunkOfCell(idx));
+    }
+    void CopyChunkOnWrite(int chunk);
+    void EqualizeWater();
+    int FindRunRoot(int run);
+    void BuildFreeRuns(); // fills _freeBelow for the whole grid
+    void UpdateFreeRunsAbove(int idx); // after the passability of idx changed
+    void FillSpan(int y, int x0, int x1, Mat_Type type, double density);
+    void StepThermal(); // diffuses heat and applies the temperature transitions of the material table
+    void ReplaceCell(int idx, Mat_Type type);
+    void StepBodies();
+    bool BodyBlocked(RigidBody &body, int top, const std::vector<BodySpan> &spans);
+    bool MoveBody(RigidBody &body, int top, const std::vector<BodySpan> &spans, int pushX, int pushY); // false if it cannot make room
+    bool PushParticle(RigidBody &body, int x, int y, int pushX, int pushY, int top, const std::vector<BodySpan> &spans);
+    int FindPushTarget(RigidBody &body, int x, int y, int pushX, int pushY, int top, const std::vector<BodySpan> &spans);
+    bool TakesPushed(RigidBody &body, Mat_Type mover, int x, int y, int top, const std::vector<BodySpan> &spans);
+    void Eject(int idx); // moves a grid particle into the flying list
+    void Emigrate(int src, int dst);
+    void StepFlying();
+    void HandOverFlying(int i, int x, int y, float vx, float vy); // sends flying particle i to the neighbouring strip
 
 private:
     std::vector<std::pair<int, int>> _frameSwaps; // src, dest
-    std::vector<Particle *> _particles;
+    HugeVector<Particle *> _particles;
+    HugeVector<unsigned char> _cellTypes; // material of every cell, kept in step with _particles for cache-friendly lookups
+    HugeVector<unsigned char> _rowMajorTypes; // scratch for RowMajorTypes in the tiled layout
+    HugeVector<int> _freeBelow;            // number of consecutive PASS_FALL cells directly below each cell
+    bool _equalizeWater = true;
+    bool _pressureEnabled = false;
+    int _pressureIterations = 8;
+    PressureField _pressure;
+    bool _thermalEnabled = true;
+    ThermalField _thermal;
+    float _conductivity[MAT_COUNT];
+    unsigned _enterMask[MAT_COUNT]; // per material, the materials it may swap into
+    unsigned _liquidMask = 0;
+    unsigned _openMask = 0; // cells flying particles pass through
+    FlyingParticles _flying;
+    int _ownedTop;
+    int _ownedBottom;
+    std::vector<Migration> _outbox;
+    std::vector<RigidBody> _bodies;
+    std::vector<BodySpan> _bodySpans; // scratch footprint for a body's next pose
+    std::vector<int> _pushVisit;      // per cell of the BODY_PUSH_RANGE box, the search that last reached it
+    std::vector<int> _pushQueue;
+    std::vector<std::pair<int, int>> _pushSwaps; // made by the current MoveBody, undone if it fails
+    int _pushSearch = 0;
+    std::vector<float> _impulseX;     // per-row scratch for ApplyImpulse
+    std::vector<float> _impulseY;
+    std::vector<WaterRun> _waterRuns;
+    std::vector<int> _runParent;
+    std::vector<EqualizeCell> _equalizeSources;
+    std::vector<EqualizeCell> _equalizeTargets;
+    std::vector<int> _equalizeTop; // highest surface row per body
     int _maxParticles;
     int _width;
     int _height;
+    int _chunksX;
+    int _chunksY;
+    std::vector<unsigned char> _chunkActive;
+    std::vector<int> _chunkWater;                // water cells per chunk
+    std::vector<unsigned char> _chunkWaterMoved; // water entered or left since the last EqualizeWater
+    std::vector<unsigned char> _equalizeChunks;  // chunks EqualizeWater scans this step
+    std::vector<int> _equalizeQueue;
+    std::vector<unsigned char> _chunkDirty; // changed since the last CollectDamageRects
+    std::vector<int> _damagedChunks;
+    std::vector<CowEpoch *> _epochs;
+    Rectangle _focus = {0, 0, 0, 0};
+    int _farInterval = 1;
+    long _step = 0;
+    std::vector<unsigned char> _chunkSkip; // chunks left out of this step's scan
+    std::vector<int> _spanMin; // per-row extents used by Stroke
+    std::vector<int> _spanMax;
+    SimStats _stats;
     double _deltaTime;
     double _currentTime;
+    FrameProfiler *_profiler = nullptr;
 };
 
 ParticleWorld::ParticleWorld(int width, int height)
 {
-    _maxParticles = width * height;
     _width = width;
     _height = height;
+    _chunksX = (width + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    _chunksY = (height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+#ifdef GRID_TILED
+    _maxParticles = _chunksX * _chunksY * CHUNK_CELLS; // partial chunks on the right and bottom are padded
+#else
+    _maxParticles = width * height;
+#endif
+    _chunkActive.assign(_chunksX * _chunksY, 0);
+    _chunkWater.assign(_chunksX * _chunksY, 0);
+    _chunkWaterMoved.assign(_chunksX * _chunksY, 0);
+    _equalizeChunks.assign(_chunksX * _chunksY, 0);
+    _chunkDirty.assign(_chunksX * _chunksY, 0);
+    _chunkSkip.assign(_chunksX * _chunksY, 0);
+    _ownedTop = 0;
+    _ownedBottom = height - 1;
+    _particles.reserve(_maxParticles);
     for (int i = 0; i < _maxParticles; i++)
     {
         Particle *tmp = new Particle{t_air, color_air()};
         _particles.push_back(tmp);
     }
+    _cellTypes.assign(_maxParticles, t_air);
+    _freeBelow.assign(_maxParticles, 0);
+    BuildFreeRuns();
+    _pressure.Resize(width, height);
+    _thermal.Resize(width, height, THERMAL_SCALE);
+    for (int i = 0; i < MAT_COUNT; i++)
+    {
+        const MaterialInfo &info = materialInfo[i];
+        _conductivity[i] = info.conductivity;
+        if (info.move == move_liquid)
+            _liquidMask |= MAT_MASK(i);
+        if (info.move == move_empty || info.move == move_gas)
+            _openMask |= MAT_MASK(i);
+        // falling materials sink into lighter cells, gases rise into denser ones; static cells never give way
+        _enterMask[i] = 0;
+        for (int t = 0; t < MAT_COUNT && info.move >= move_powder; t++)
+        {
+            if (t == i || materialInfo[t].move == move_static)
+                continue;
+            bool lighter = materialInfo[t].density < info.density;
+            if (info.move == move_gas ? !lighter : lighter)
+                _enterMask[i] |= MAT_MASK(t);
+        }
+    }
 }
 
 ParticleWorld::~ParticleWorld()
@@ -138,53 +505,135 @@ ParticleWorld::~ParticleWorld()
 
 void ParticleWorld::UpdateParticles()
 {
-    for (int y = _height - 1; y >= 0; y--)
+    ScopedTimer updateTimer(_profiler, phase_update);
+    ScopedTimer scanTimer(_profiler, phase_scan);
+    TRACE_SCOPE("UpdateParticles");
+    _stats = SimStats();
+    StepBodies();
+    StepFlying();
+    if (_pressureEnabled)
     {
-        for (int x = 0; x < _width; x++)
+        ScopedTimer pressureTimer(_profiler, phase_pressure);
+        TRACE_SCOPE("PressureSolve");
+        _pressure.Build(RowMajorTypes(), t_water, t_air);
+        _pressure.Solve(_pressureIterations);
+    }
+    if (_farInterval > 1)
+    {
+        // a chunk's margin keeps the cells just outside the focus, which the focus reacts to, at full rate
+        for (int cy = 0; cy < _chunksY; cy++)
         {
-            Particle *p = ParticleAtCoord(x, y);
-            switch (p->getType())
-            {
-            case t_air:
+            for (int cx = 0; cx < _chunksX; cx++)
             {
-                break;
-            }
-            case t_sand:
-            {
-                UpdateSand(x, y);
-                break;
+                bool near = (cx + 2) * CHUNK_SIZE > _focus.x && (cx - 1) * CHUNK_SIZE < _focus.x + _focus.width &&
+                            (cy + 2) * CHUNK_SIZE > _focus.y && (cy - 1) * CHUNK_SIZE < _focus.y + _focus.height;
+                bool skip = !near && (cx + cy + _step) % _farInterval != 0;
+                _chunkSkip[cy * _chunksX + cx] = skip;
+                _stats.skippedChunks += skip;
             }
-            case t_solid:
+        }
+    }
+    _step++;
+    for (int bandTop = _ownedBottom; bandTop >= _ownedTop; bandTop -= TRACE_BAND_ROWS)
+    {
+        TRACE_SCOPE_NAMED(bandScope, "scan rows");
+        int moverCount = 0;
+#ifdef GRID_TILED
+        // chunk by chunk, so the scan walks the cells and their particles forwards through memory; moves
+        // are only applied after the scan, so this only changes which random numbers each cell draws
+        for (int cx = 0; cx < _chunksX; cx++)
+        {
+            for (int y = bandTop; y > bandTop - TRACE_BAND_ROWS && y >= _ownedTop; y--)
             {
-                break;
-            }
-            case t_water:
+#else
+        for (int y = bandTop; y > bandTop - TRACE_BAND_ROWS && y >= _ownedTop; y--)
+        {
+            for (int cx = 0; cx < _chunksX; cx++)
             {
-                UpdateWater(x, y);
-                break;
-            }
+#endif
+                if (_chunkSkip[(y / CHUNK_SIZE) * _chunksX + cx])
+                    continue;
+                int xEnd = std::min((cx + 1) * CHUNK_SIZE, _width);
+                // the part of a row inside a chunk is contiguous in either layout
+                for (int x = cx * CHUNK_SIZE, idx = CellIndex(x, y); x < xEnd; x++, idx++)
+                {
+                    Mat_Type type = _cellTypes[idx];
+                    const MaterialInfo &info = materialInfo[type];
+                    _stats.materialCounts[type]++;
+                    if (info.lifetime > 0)
+                    {
+                        BeforeWrite(idx);
+                        Particle *p = _particles[idx];
+                        p->setLife(p->getLife() - 1);
+                        if (p->getLife() <= 0)
+                        {
+                            ReplaceCell(idx, info.decayTo);
+                            continue;
+                        }
+                    }
+                    if (info.heatOutput > 0.0f && _thermalEnabled)
+                        _thermal.AddHeat(x, y, 0, info.heatOutput);
+                    if (info.move >= move_powder)
+                    {
+                        UpdateMovable(x, y);
+                        moverCount++;
+                    }
+                }
             }
         }
+        _stats.scanned += moverCount;
+        if (bandScope.isActive())
+            bandScope.setArgs("\"y\":" + std::to_string(bandTop) + ",\"movers\":" + std::to_string(moverCount));
     }
+    scanTimer.Stop();
+    _stats.flying = _flying.size();
     CommitChanges();
+    if (_equalizeWater)
+        EqualizeWater();
+    if (_thermalEnabled)
+        StepThermal();
 }
 
 void ParticleWorld::CommitChanges()
 {
+    TRACE_SCOPE("CommitChanges");
+    TRACE_COUNTER("proposed moves", _frameSwaps.size());
+    ScopedTimer filterTimer(_profiler, phase_commit_filter);
+    _stats.proposed = _frameSwaps.size();
+    std::fill(_chunkActive.begin(), _chunkActive.end(), 0);
+    for (int i = 0; i < _frameSwaps.size(); i++)
+        _chunkActive[ChunkOfCell(_frameSwaps[i].first)] = 1;
+    _stats.activeChunks = std::count(_chunkActive.begin(), _chunkActive.end(), 1);
     for (int i = 0; i < _frameSwaps.size(); i++)
     {
-        if (!IsEmptyOrWater(ParticleAtIndex(_frameSwaps[i].second)))
+        int dst = _frameSwaps[i].second;
+        if (dst < 0 || !(_enterMask[_cellTypes[_frameSwaps[i].first]] & MAT_MASK(_cellTypes[dst])))
         {
+            _stats.rejectedOccupied++;
             _frameSwaps[i] = _frameSwaps.back();
             _frameSwaps.pop_back();
             i--;
         }
     }
+    filterTimer.Stop();
 
+    ScopedTimer sortTimer(_profiler, phase_commit_sort);
+#ifdef GRID_TILED
+    // moves are applied in row-major order of their destinations in either layout, since a move can
+    // carry along what an earlier one swapped into its source
+    for (auto &swap : _frameSwaps)
+        swap.second = CellY(swap.second) * _width + CellX(swap.second);
+#endif
     std::sort(_frameSwaps.begin(), _frameSwaps.end(),
               [](auto &a, auto &b)
               { return a.second < b.second; });
+#ifdef GRID_TILED
+    for (auto &swap : _frameSwaps)
+        swap.second = CellIndex(swap.second % _width, swap.second / _width);
+#endif
+    sortTimer.Stop();
 
+    ScopedTimer applyTimer(_profiler, phase_commit_apply);
     int iprev = 0;
 
     _frameSwaps.emplace_back(-1, -1);
@@ -197,7 +646,14 @@ void ParticleWorld::CommitChanges()
             int dst = _frameSwaps[rand].first;
             int src = _frameSwaps[rand].second;
 
-            SwapParticles(dst, src);
+            if (CellY(src) < _ownedTop || CellY(src) > _ownedBottom)
+                Emigrate(dst, src);
+            else
+            {
+                SwapParticles(dst, src);
+                _stats.swapsApplied++;
+            }
+            _stats.contentionLosers += i - iprev;
 
             iprev = i + 1;
         }
@@ -225,10 +681,16 @@ Particle *ParticleWorld::ParticleAtCoord(int x, int y)
 void ParticleWorld::SetParticle(int x, int y, Particle *particle)
 {
     if (!InBounds(x, y))
+    {
+        delete particle;
         return;
+    }
+    BeforeWrite(CoordToIndex(x, y));
     Particle *tmp = _particles[CoordToIndex(x, y)];
     delete tmp;
     _particles[CoordToIndex(x, y)] = particle;
+    SetCellType(CoordToIndex(x, y), particle->getType());
+    MarkDirty(x, y);
 }
 
 void ParticleWorld::SetParticle(Vector2 v, Particle *particle)
@@ -236,11 +698,90 @@ void ParticleWorld::SetParticle(Vector2 v, Particle *particle)
     SetParticle(v.x, v.y, particle);
 }
 
+void ParticleWorld::FillSpan(int y, int x0, int x1, Mat_Type type, double density)
+{
+    if (y < 0 || y >= _height)
+        return;
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, _width - 1);
+    if (x0 > x1)
+        return;
+    for (int x = x0; x <= x1; x++)
+    {
+        if (density < 1.0 && randomBetween(0.0, 1.0) >= density)
+            continue;
+        int idx = CellIndex(x, y);
+        BeforeWrite(idx);
+        delete _particles[idx];
+        _particles[idx] = MakeParticle(type);
+        SetCellType(idx, type);
+    }
+    for (int x = x0 - x0 % CHUNK_SIZE; x <= x1; x += CHUNK_SIZE)
+        MarkDirty(x, y);
+}
+
+void ParticleWorld::FillRect(int x0, int y0, int x1, int y1, Mat_Type type, double density)
+{
+    for (int y = std::max(y0, _ownedTop); y <= std::min(y1, _ownedBottom); y++)
+        FillSpan(y, x0, x1, type, density);
+}
+
+void ParticleWorld::FillCircle(int cx, int cy, int radius, Mat_Type type, double density)
+{
+    Stroke(cx, cy, cx, cy, radius, type, density);
+}
+
+void ParticleWorld::Stroke(int x0, int y0, int x1, int y1, int radius, Mat_Type type, double density)
+{
+    radius = std::max(radius, 0);
+    int top = std::min(y0, y1) - radius;
+    int rows = std::abs(y1 - y0) + 2 * radius + 1;
+    _spanMin.assign(rows, _width);
+    _spanMax.assign(rows, -1);
+
+    // union of the discs centred on every step of a Bresenham walk; each row of the capsule is one span
+    int dx = std::abs(x1 - x0);
+    int dy = -std::abs(y1 - y0);
+    int sx = x0 < x1 ? 1 : -1;
+    int sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+    int x = x0;
+    int y = y0;
+    while (true)
+    {
+        for (int oy = -radius; oy <= radius; oy++)
+        {
+            int half = (int)std::sqrt((double)(radius * radius - oy * oy));
+            int row = y + oy - top;
+            _spanMin[row] = std::min(_spanMin[row], x - half);
+            _spanMax[row] = std::max(_spanMax[row], x + half);
+        }
+        if (x == x1 && y == y1)
+            break;
+        int e2 = 2 * err;
+        if (e2 >= dy)
+        {
+            err += dy;
+            x += sx;
+        }
+        if (e2 <= dx)
+        {
+            err += dx;
+            y += sy;
+        }
+    }
+    for (int row = 0; row < rows; row++)
+    {
+        if (_spanMin[row] <= _spanMax[row])
+            FillSpan(top + row, _spanMin[row], _spanMax[row], type, density);
+    }
+}
+
 int ParticleWorld::CoordToIndex(int x, int y)
 {
     if (!InBounds(x, y))
         return -1;
-    return y * _width + x;
+    return CellIndex(x, y);
 }
 
 int ParticleWorld::CoordToIndex(Vector2 v)
@@ -250,170 +791,1092 @@ int ParticleWorld::CoordToIndex(Vector2 v)
 
 Vector2 ParticleWorld::IndexToCoord(int idx)
 {
-    int x = idx % _width;
-    int y = idx / _width;
+    int x = CellX(idx);
+    int y = CellY(idx);
     Vector2 vec{(float)x, (float)y};
     return vec;
 }
 
-void ParticleWorld::UpdateSand(int x, int y)
+void ParticleWorld::UpdateMovable(int x, int y)
 {
-    double deltaPass = 0.2;
-    Particle *p = ParticleAtCoord(x, y);
+    int idx = CellIndex(x, y);
+    Particle *p = _particles[idx];
+    const MaterialInfo &info = materialInfo[_cellTypes[idx]];
+    unsigned enter = _enterMask[_cellTypes[idx]];
+    int dir = info.move == move_gas ? -1 : 1; // "down" is up for gases
+    bool flows = info.move != move_powder;
     Vector2 vel = p->getVelocity();
+    // thrown sideways or upwards faster than the grid kernels can follow; falling is left to TraceMove
+    float upward = std::min(vel.y, 0.0f);
+    if (info.move != move_gas && vel.x * vel.x + upward * upward > FLY_EJECT_SPEED * FLY_EJECT_SPEED)
+    {
+        Eject(idx);
+        return;
+    }
     Vector2 accel = p->getAcceleration();
     // calculate y velocity
     float xVelocity = vel.x + accel.x * _deltaTime;
     float yVelocity = vel.y + accel.y * _deltaTime;
+    if (info.maxSpeed > 0.0f)
+        yVelocity = std::min(yVelocity, info.maxSpeed);
     int xDelta = xVelocity;
-    int yDelta = yVelocity;
-    bool down = IsEmptyOrWater(x, y + 1) && InBounds(x, y + 1);
-    bool downLeft = IsEmptyOrWater(x - 1, y + 1) && InBounds(x - 1, y + 1);
-    bool downRight = IsEmptyOrWater(x + 1, y + 1) && InBounds(x + 1, y + 1);
-    if (!down)
-    {
+    // the neighbours are stepped to from idx rather than looked up by coordinates, which is cheaper in the tiled layout
+    bool hasLeft = x > 0;
+    bool hasRight = x + 1 < _width;
+    int next = dir > 0 ? (y + 1 < _height ? CellBelow(idx, y) : -1) : (y > 0 ? CellAbove(idx, y) : -1);
+    unsigned nextMask = next >= 0 ? MAT_MASK(_cellTypes[next]) : 0;
+    bool down = enter & nextMask;
+    bool downLeft = next >= 0 && hasLeft && (enter & MAT_MASK(_cellTypes[CellLeft(next, x)]));
+    bool downRight = next >= 0 && hasRight && (enter & MAT_MASK(_cellTypes[CellRight(next, x)]));
+    bool left = flows && hasLeft && (enter & MAT_MASK(_cellTypes[CellLeft(idx, x)]));
+    bool right = flows && hasRight && (enter & MAT_MASK(_cellTypes[CellRight(idx, x)]));
+    // landing, or moving into a liquid, resets the speed
+    if (!down || (_liquidMask & nextMask))
         yVelocity = 1.0f;
-        yDelta = yVelocity;
-    }
-    if (IsWater(x, y + 1))
+    int yDelta = (int)yVelocity * dir;
+
+    // with the pressure field on, liquid ties are broken towards lower head instead of by a coin flip
+    double towardsRight = 0.5;
+    bool biased = _pressureEnabled && info.move == move_liquid;
+    if (biased && ((left && right) || (downLeft && downRight)))
+        towardsRight = 0.5 - std::max(-0.45, std::min(0.45, 0.15 * _pressure.GradientX(x, y)));
+    if (left && right)
     {
-        yVelocity = 1.0f;
-        yDelta = yVelocity;
+        left = biased ? randomBetween(0.0, 1.0) >= towardsRight : std::rand() % 2;
+        right = !left;
     }
-    p->setVelocity(Vector2{(float)xVelocity, (float)yVelocity});
-
     if (downLeft && downRight)
     {
-        downLeft = std::rand() % 2;
+        downLeft = biased ? randomBetween(0.0, 1.0) >= towardsRight : std::rand() % 2;
         downRight = !downLeft;
     }
+    if (left != right)
+    { // add spread velocity
+        int direction = 1 - (left * 2);
+        xVelocity = direction * (rand() % 5 + 5.f);
+        xDelta = xVelocity;
+    }
+    if (down && (downLeft || downRight) && info.dispersion > 0.0f && randomBetween(0.0, 1.0) < info.dispersion)
+        down = false;
+    p->setVelocity(Vector2{(float)xVelocity, (float)yVelocity});
+    int dstX = x;
+    int dstY = y;
     if (down)
     {
-        int dstY = y;
-        for (int i = 1; i <= yDelta; i++)
+        TraceMove(x, y, 0, yDelta, enter, dstX, dstY);
+        MoveParticle(x, y, dstX, dstY);
+    }
+    else if (downLeft || downRight)
+    {
+        int side = downLeft ? -1 : 1;
+        // powders slide along the diagonal at their fall speed, fluids take a single step
+        if (flows)
+            MoveParticle(x, y, x + side, y + dir);
+        else
         {
-            int t = y + i;
-            if (IsEmptyOrWater(x, t) && InBounds(x, t))
+            TraceMove(x, y, side, yDelta, enter, dstX, dstY);
+            MoveParticle(x, y, dstX, dstY);
+        }
+    }
+    else if (left || right)
+    {
+        TraceMove(x, y, xDelta, 0, enter, dstX, dstY);
+        MoveParticle(x, y, dstX, dstY);
+    }
+}
+
+// walks the line from (x, y) towards (x + dx, y + dy) and returns the last cell before the first
+// one that is out of bounds or whose material is not in mask; (x, y) itself if the first step is blocked
+void ParticleWorld::TraceMove(int x, int y, int dx, int dy, unsigned mask, int &outX, int &outY)
+{
+    outX = x;
+    outY = y;
+    if (dx == 0 && dy > 0 && mask == PASS_FALL)
+    {
+        outY = y + std::min(dy, _freeBelow[CellIndex(x, y)]);
+        return;
+    }
+    if (dx == 0 && dy != 0)
+    {
+        // straight falls walk the column directly; the bounds check is folded into the step count
+        int sy = dy > 0 ? 1 : -1;
+        int steps = std::min(std::abs(dy), dy > 0 ? _height - 1 - y : y);
+        int idx = CellIndex(x, y);
+        for (int i = 0; i < steps; i++)
+        {
+            idx = sy > 0 ? CellBelow(idx, outY) : CellAbove(idx, outY);
+            if (!(mask & MAT_MASK(_cellTypes[idx])))
+                return;
+            outY += sy;
+        }
+        return;
+    }
+    int adx = std::abs(dx);
+    int ady = std::abs(dy);
+    int sx = dx > 0 ? 1 : -1;
+    int sy = dy > 0 ? 1 : -1;
+    int err = adx - ady;
+    int steps = std::max(adx, ady);
+    int cx = x;
+    int cy = y;
+    for (int i = 0; i < steps; i++)
+    {
+        int e2 = 2 * err;
+        if (e2 > -ady)
+        {
+            err -= ady;
+            cx += sx;
+        }
+        if (e2 < adx)
+        {
+            err += adx;
+            cy += sy;
+        }
+        if (!Passable(cx, cy, mask))
+            return;
+        outX = cx;
+        outY = cy;
+    }
+}
+
+void ParticleWorld::MoveParticle(int x1, int y1, int x2, int y2)
+{
+    _frameSwaps.emplace_back(CoordToIndex(x1, y1), CoordToIndex(x2, y2));
+}
+
+void ParticleWorld::SwapParticles(int x1, int y1, int x2, int y2)
+{
+    SwapParticles(CoordToIndex(x1, y1), CoordToIndex(x2, y2));
+}
+
+void ParticleWorld::SwapParticles(int id1, int id2)
+{
+    BeforeWrite(id1);
+    BeforeWrite(id2);
+    Particle *tmp = ParticleAtIndex(id1);
+    _particles[id1] = ParticleAtIndex(id2);
+    _particles[id2] = tmp;
+    Mat_Type type1 = _cellTypes[id1];
+    Mat_Type type2 = _cellTypes[id2];
+    // the cell that becomes blocked goes first: a fall then only walks the free runs above its source once
+    if ((PASS_FALL >> type1) & 1)
+    {
+        SetCellType(id1, type2);
+        SetCellType(id2, type1);
+    }
+    else
+    {
+        SetCellType(id2, type1);
+        SetCellType(id1, type2);
+    }
+    MarkDirty(id1);
+    MarkDirty(id2);
+}
+
+int ParticleWorld::FindRunRoot(int run)
+{
+    while (_runParent[run] != run)
+    {
+        _runParent[run] = _runParent[_runParent[run]];
+        run = _runParent[run];
+    }
+    return run;
+}
+
+// Moves water from the top of each connected body to the lowest open cells next to it, so bodies
+// level out in bulk instead of waiting for single particles to random-walk across the surface.
+// Bodies are found from per-row water runs joined where they overlap the run above.
+void ParticleWorld::EqualizeWater()
+{
+    ScopedTimer equalizeTimer(_profiler, phase_equalize);
+    TRACE_SCOPE("EqualizeWater");
+    _waterRuns.clear();
+    _runParent.clear();
+    _equalizeSources.clear();
+    _equalizeTargets.clear();
+
+    // a body no water moved in or out of since the last pass is as level as this pass leaves it, so only
+    // chunks where water moved are scanned, together with the water-holding chunks connected to them;
+    // every body touching one of those lies entirely inside that set
+    _equalizeQueue.clear();
+    for (int chunk = 0; chunk < _chunksX * _chunksY; chunk++)
+    {
+        _equalizeChunks[chunk] = _chunkWaterMoved[chunk];
+        if (_chunkWaterMoved[chunk])
+            _equalizeQueue.push_back(chunk);
+        _chunkWaterMoved[chunk] = 0;
+    }
+    if (_equalizeQueue.empty())
+        return;
+    for (size_t q = 0; q < _equalizeQueue.size(); q++)
+    {
+        int cx = _equalizeQueue[q] % _chunksX;
+        int cy = _equalizeQueue[q] / _chunksX;
+        int neighbours[4][2] = {{cx - 1, cy}, {cx + 1, cy}, {cx, cy - 1}, {cx, cy + 1}};
+        for (auto &n : neighbours)
+        {
+            if (n[0] < 0 || n[0] >= _chunksX || n[1] < 0 || n[1] >= _chunksY)
+                continue;
+            int chunk = n[1] * _chunksX + n[0];
+            if (!_equalizeChunks[chunk] && _chunkWater[chunk] > 0)
             {
-                dstY = t;
+                _equalizeChunks[chunk] = 1;
+                _equalizeQueue.push_back(chunk);
             }
-            else
+        }
+    }
+
+    int prevRowStart = 0;
+    int prevRowEnd = 0;
+    for (int y = 0; y < _height; y++)
+    {
+        int rowStart = _waterRuns.size();
+        const unsigned char *rowChunks = &_equalizeChunks[(y / CHUNK_SIZE) * _chunksX];
+        int next = 0; // a run can reach into the next chunk, which is then part of the scan as well
+        for (int cx = 0; cx < _chunksX; cx++)
+        {
+            if (!rowChunks[cx])
+                continue;
+            int xEnd = std::min((cx + 1) * CHUNK_SIZE, _width);
+            for (int x = std::max(cx * CHUNK_SIZE, next); x < xEnd; x++)
             {
-                break;
+                if (_cellTypes[CellIndex(x, y)] != t_water)
+                    continue;
+                int x0 = x;
+                while (x + 1 < _width && _cellTypes[CellIndex(x + 1, y)] == t_water)
+                    x++;
+                _waterRuns.push_back(WaterRun{y, x0, x});
+                _runParent.push_back(_waterRuns.size() - 1);
+                next = x + 1;
             }
         }
-        MoveParticle(x, y, x, dstY);
+        int rowEnd = _waterRuns.size();
+        // join with overlapping runs of the row above; both lists are sorted by x
+        int j = prevRowStart;
+        for (int i = rowStart; i < rowEnd; i++)
+        {
+            while (j < prevRowEnd && _waterRuns[j].x1 < _waterRuns[i].x0)
+                j++;
+            for (int k = j; k < prevRowEnd && _waterRuns[k].x0 <= _waterRuns[i].x1; k++)
+            {
+                int a = FindRunRoot(i);
+                int b = FindRunRoot(k);
+                if (a != b)
+                    _runParent[a] = b;
+            }
+        }
+        prevRowStart = rowStart;
+        prevRowEnd = rowEnd;
     }
-    else if (downLeft)
+    if (_waterRuns.empty())
+        return;
+
+    int runCount = (int)_waterRuns.size();
+    _equalizeTop.assign(runCount, _height);
+    for (int i = 0; i < runCount; i++)
     {
-        MoveParticle(x, y, x - 1, y + yDelta);
+        WaterRun &run = _waterRuns[i];
+        int body = FindRunRoot(i);
+        int y = run.y;
+        // surface cells can give water away
+        for (int x = run.x0; x <= run.x1; x++)
+        {
+            if (y > 0 && _cellTypes[CellIndex(x, y - 1)] == t_air)
+            {
+                _equalizeSources.push_back(EqualizeCell{body, y, CellIndex(x, y)});
+                _equalizeTop[body] = std::min(_equalizeTop[body], y);
+            }
+        }
+        // open cells beside the run, only where something holds water up below them
+        int sides[2] = {run.x0 - 1, run.x1 + 1};
+        for (int x : sides)
+        {
+            if (x < 0 || x >= _width || _cellTypes[CellIndex(x, y)] != t_air)
+                continue;
+            if (y + 1 < _height && _cellTypes[CellIndex(x, y + 1)] == t_air)
+                continue;
+            _equalizeTargets.push_back(EqualizeCell{body, y, CellIndex(x, y)});
+        }
     }
-    else if (downRight)
+    // the air above a surface cell can take water from a higher part of the same body, e.g. the other
+    // side of a U-bend; above the top surface of a body it is never lower than any source
+    int surfaceCount = (int)_equalizeSources.size();
+    for (int i = 0; i < surfaceCount; i++)
     {
-        MoveParticle(x, y, x + 1, y + yDelta);
+        const EqualizeCell &source = _equalizeSources[i];
+        if (source.y - 1 > _equalizeTop[source.body])
+            _equalizeTargets.push_back(EqualizeCell{source.body, source.y - 1, CellAbove(source.idx, source.y)});
+    }
+
+    std::sort(_equalizeSources.begin(), _equalizeSources.end(), [](const EqualizeCell &a, const EqualizeCell &b)
+              { return a.body != b.body ? a.body < b.body : a.y != b.y ? a.y < b.y : a.idx < b.idx; });
+    std::sort(_equalizeTargets.begin(), _equalizeTargets.end(), [](const EqualizeCell &a, const EqualizeCell &b)
+              { return a.body != b.body ? a.body < b.body : a.y != b.y ? a.y > b.y : a.idx < b.idx; });
+    _equalizeTargets.erase(std::unique(_equalizeTargets.begin(), _equalizeTargets.end(), [](const EqualizeCell &a, const EqualizeCell &b)
+                                       { return a.body == b.body && a.idx == b.idx; }),
+                           _equalizeTargets.end());
+
+    // pair the highest surface cells with the lowest open cells of the same body while that lowers the water;
+    // at most half the surface moves per step so the flow stays visible
+    int sourceCount = (int)_equalizeSources.size();
+    int targetCount = (int)_equalizeTargets.size();
+    int s = 0;
+    int t = 0;
+    while (s < sourceCount && t < targetCount)
+    {
+        int body = std::min(_equalizeSources[s].body, _equalizeTargets[t].body);
+        int sEnd = s;
+        while (sEnd < sourceCount && _equalizeSources[sEnd].body == body)
+            sEnd++;
+        int tEnd = t;
+        while (tEnd < targetCount && _equalizeTargets[tEnd].body == body)
+            tEnd++;
+        int budget = std::max(1, (sEnd - s) / 2);
+        for (int i = s, j = t; i < sEnd && j < tEnd && budget > 0; j++)
+        {
+            if (_equalizeTargets[j].y <= _equalizeSources[i].y)
+                break;
+            // a cell beside two bodies may already have been filled by the other one; the source then
+            // tries the next target
+            if (_cellTypes[_equalizeTargets[j].idx] != t_air)
+                continue;
+            SwapParticles(_equalizeSources[i].idx, _equalizeTargets[j].idx);
+            _stats.equalized++;
+            i++;
+            budget--;
+        }
+        s = sEnd;
+        t = tEnd;
     }
 }
 
-void ParticleWorld::UpdateWater(int x, int y)
+void ParticleWorld::SetCellType(int idx, Mat_Type type)
 {
-    Particle *p = ParticleAtCoord(x, y);
-    Vector2 vel = p->getVelocity();
-    Vector2 accel = p->getAcceleration();
-    // calculate y velocity
-    float xVelocity = vel.x + accel.x * _deltaTime;
-    float yVelocity = vel.y + accel.y * _deltaTime;
-    int xDelta = xVelocity;
-    int yDelta = yVelocity;
-    bool down = IsEmpty(x, y + 1) && InBounds(x, y + 1);
-    bool left = IsEmpty(x - 1, y) && InBounds(x - 1, y);
-    bool right = IsEmpty(x + 1, y) && InBounds(x + 1, y);
-    bool downLeft = IsEmpty(x - 1, y + 1) && InBounds(x - 1, y + 1);
-    bool downRight = IsEmpty(x + 1, y + 1) && InBounds(x + 1, y + 1);
-    if (!down)
+    Mat_Type old = _cellTypes[idx];
+    _cellTypes[idx] = type;
+    if (((PASS_FALL >> old) ^ (PASS_FALL >> type)) & 1)
+        UpdateFreeRunsAbove(idx);
+    if ((old == t_water) != (type == t_water))
     {
-        yVelocity = 1.0f;
-        yDelta = yVelocity;
+        int chunk = ChunkOfCell(idx);
+        _chunkWater[chunk] += type == t_water ? 1 : -1;
+        _chunkWaterMoved[chunk] = 1;
     }
+}
 
-    if (left && right)
+void ParticleWorld::BuildFreeRuns()
+{
+    for (int column = 0; column < _chunksX; column++)
     {
-        left = std::rand() % 2;
-        right = !left;
+        int x0 = column * CHUNK_SIZE;
+        int x1 = std::min(x0 + CHUNK_SIZE, _width);
+        // a cell's run only depends on the cells below it, so the rows are filled bottom up;
+        // the part of a row inside one chunk column is contiguous in either layout
+        int width = x1 - x0;
+        std::fill(&_freeBelow[CellIndex(x0, _height - 1)], &_freeBelow[CellIndex(x0, _height - 1)] + width, 0);
+        for (int y = _height - 2; y >= 0; y--)
+        {
+            const unsigned char *belowType = &_cellTypes[CellIndex(x0, y + 1)];
+            const int *belowRun = &_freeBelow[CellIndex(x0, y + 1)];
+            int *run = &_freeBelow[CellIndex(x0, y)];
+            for (int x = 0; x < width; x++)
+                run[x] = ((PASS_FALL >> belowType[x]) & 1) ? belowRun[x] + 1 : 0;
+        }
     }
-    if (downLeft && downRight)
+}
+
+void ParticleWorld::UpdateFreeRunsAbove(int idx)
+{
+    // only the cells above idx in its column can change, and only up to the first one that is not
+    // PASS_FALL itself, since everything above that still stops there; a run that already has its
+    // value means the rest of the column is up to date as well
+    int y = CellY(idx);
+    int run = ((PASS_FALL >> _cellTypes[idx]) & 1) ? _freeBelow[idx] + 1 : 0;
+    while (y > 0)
     {
-        downLeft = std::rand() % 2;
-        downRight = !downLeft;
+        idx = CellAbove(idx, y--);
+        if (_freeBelow[idx] == run)
+            return;
+        _freeBelow[idx] = run;
+        if (!((PASS_FALL >> _cellTypes[idx]) & 1))
+            return;
+        run++;
     }
-    if(left != right) {//add spread velocity
-        int direction = 1 - (left * 2);
-        xVelocity = direction * (rand() % 5 + 5.f);
-        xDelta = xVelocity;
-    }
-    p->setVelocity(Vector2{(float)xVelocity, (float)yVelocity});
-    if (down)
+}
+
+void ParticleWorld::StepThermal()
+{
+    if (_thermal.isIdle())
+        return;
+    ScopedTimer thermalTimer(_profiler, phase_thermal);
+    TRACE_SCOPE("StepThermal");
+    _thermal.Build(RowMajorTypes(), _conductivity);
+    _thermal.Diffuse();
+
+    float coldestTransition = THERMAL_MAX;
+    for (int i = 0; i < MAT_COUNT; i++)
+        if (materialInfo[i].transitionTemp > 0.0f)
+            coldestTransition = std::min(coldestTransition, materialInfo[i].transitionTemp);
+    // only thermal cells hot enough for some transition look at the world cells they cover
+    int scale = _thermal.getScale();
+    float latentShare = 1.0f / (scale * scale);
+    for (int cy = 0; cy < _thermal.getCoarseHeight(); cy++)
     {
-        int dstY = y;
-        for (int i = 1; i <= yDelta; i++)
+        for (int cx = 0; cx < _thermal.getCoarseWidth(); cx++)
         {
-            int t = y + i;
-            if (IsEmptyOrWater(x, t) && InBounds(x, t))
+            float temp = _thermal.CellTemperature(cx, cy);
+            if (temp < coldestTransition)
+                continue;
+            for (int y = cy * scale; y < std::min((cy + 1) * scale, _height); y++)
             {
-                dstY = t;
+                for (int x = cx * scale; x < std::min((cx + 1) * scale, _width); x++)
+                {
+                    int idx = CellIndex(x, y);
+                    const MaterialInfo &info = materialInfo[_cellTypes[idx]];
+                    if (info.transitionTemp <= 0.0f || temp < info.transitionTemp)
+                        continue;
+                    ReplaceCell(idx, info.transitionTo);
+                    _thermal.AddHeatAt(cx, cy, -info.latentHeat * latentShare);
+                    _stats.transitions++;
+                }
             }
-            else
+        }
+    }
+}
+
+void ParticleWorld::ReplaceCell(int idx, Mat_Type type)
+{
+    BeforeWrite(idx);
+    delete _particles[idx];
+    _particles[idx] = MakeParticle(type);
+    SetCellType(idx, type);
+    MarkDirty(idx);
+}
+
+int ParticleWorld::AddBody(const std::vector<Vector2> &shape, Vector2 position, float angle, Vector2 velocity, float angularVelocity)
+{
+    RigidBody body;
+    body.shape = shape;
+    body.position = position;
+    body.angle = angle;
+    body.velocity = velocity;
+    body.angularVelocity = angularVelocity;
+    for (Vector2 v : shape)
+        body.radius = std::max(body.radius, std::sqrt(v.x * v.x + v.y * v.y));
+    body.color = ColorBrightness(GRAY, randomBetween(-0.4f, 0.2f));
+    int top;
+    RasterizeConvex(shape, position, angle, top, _bodySpans);
+    if (BodyBlocked(body, top, _bodySpans) || !MoveBody(body, top, _bodySpans, 0, -1))
+        return -1;
+    _bodies.push_back(body);
+    return _bodies.size() - 1;
+}
+
+// integrates every body and moves it in steps of at most one cell, so it cannot tunnel through thin walls;
+// a step that would overlap static cells, or leave a displaced particle nowhere to go, ends the body's
+// motion for this frame
+void ParticleWorld::StepBodies()
+{
+    if (_bodies.empty())
+        return;
+    ScopedTimer bodiesTimer(_profiler, phase_bodies);
+    TRACE_SCOPE("StepBodies");
+    for (RigidBody &body : _bodies)
+    {
+        body.velocity.y = std::min(body.velocity.y + (float)(GRAVITY * _deltaTime), BODY_MAX_SPEED);
+        float travel = std::max(std::max(std::abs(body.velocity.x), std::abs(body.velocity.y)), std::abs(body.angularVelocity) * body.radius);
+        int substeps = std::max(1, (int)std::ceil(travel));
+        Vector2 step = {body.velocity.x / substeps, body.velocity.y / substeps};
+        float turn = body.angularVelocity / substeps;
+        int pushX = body.velocity.x > 0.5f ? 1 : body.velocity.x < -0.5f ? -1 : 0;
+        int pushY = body.velocity.y >= 0.0f ? 1 : -1;
+        for (int i = 0; i < substeps; i++)
+        {
+            Vector2 next = {body.position.x + step.x, body.position.y + step.y};
+            int top;
+            RasterizeConvex(body.shape, next, body.angle + turn, top, _bodySpans);
+            if (BodyBlocked(body, top, _bodySpans) || !MoveBody(body, top, _bodySpans, pushX, pushY))
             {
+                // landed or hit a wall: stop falling and bleed off the rest
+                body.velocity.y = 0.0f;
+                body.velocity.x *= 0.8f;
+                body.angularVelocity *= 0.5f;
                 break;
             }
+            body.position = next;
+            body.angle += turn;
         }
-        MoveParticle(x, y, x, dstY);
     }
-    else if (downLeft)
+}
+
+// only the cells the body would newly cover can collide, so this costs the length of the leading edge
+bool ParticleWorld::BodyBlocked(RigidBody &body, int top, const std::vector<BodySpan> &spans)
+{
+    BodySpan added[2];
+    for (int row = 0; row < (int)spans.size(); row++)
     {
-        MoveParticle(x, y, x - 1, y + 1);
+        int y = top + row;
+        int n = SpanDifference(spans[row], SpanAtRow(body.top, body.spans, y), added);
+        for (int i = 0; i < n; i++)
+        {
+            if (y < 0 || y >= _height || added[i].x0 < 0 || added[i].x1 >= _width)
+                return true;
+            for (int x = added[i].x0; x <= added[i].x1; x++)
+                if (materialInfo[_cellTypes[CellIndex(x, y)]].move == move_static)
+                    return true;
+        }
     }
-    else if (downRight)
+    return false;
+}
+
+// rewrites only the cells that differ between the body's current footprint and the new one:
+// newly covered cells push their particle out of the way, uncovered cells become air. All the pushing
+// happens before anything is written and is undone if some particle has no room, so a body that cannot
+// make room is left exactly as it was
+bool ParticleWorld::MoveBody(RigidBody &body, int top, const std::vector<BodySpan> &spans, int pushX, int pushY)
+{
+    BodySpan diff[2];
+    int first = std::min(top, body.top);
+    int last = std::max(top + (int)spans.size(), body.top + (int)body.spans.size());
+    _pushSwaps.clear();
+    for (int y = first; y < last; y++)
     {
-        MoveParticle(x, y, x + 1, y + 1);
+        int n = SpanDifference(SpanAtRow(top, spans, y), SpanAtRow(body.top, body.spans, y), diff);
+        for (int i = 0; i < n; i++)
+        {
+            for (int x = diff[i].x0; x <= diff[i].x1; x++)
+            {
+                if (PushParticle(body, x, y, pushX, pushY, top, spans))
+                    continue;
+                for (auto it = _pushSwaps.rbegin(); it != _pushSwaps.rend(); ++it)
+                    SwapParticles(it->first, it->second);
+                return false;
+            }
+        }
     }
-    else if (left || right)
+    for (int y = first; y < last; y++)
     {
-        int dstX = x;
-        int direction = xDelta > 0 ? 1 : -1;
-        xDelta = abs(xDelta);
-        for (int i = 1; i <= xDelta; i++)
+        int n = SpanDifference(SpanAtRow(body.top, body.spans, y), SpanAtRow(top, spans, y), diff);
+        for (int i = 0; i < n; i++)
         {
-            int t = x + (i * direction);
-            if (IsEmptyOrWater(t, y) && InBounds(t, y))
+            for (int x = diff[i].x0; x <= diff[i].x1; x++)
             {
-                dstX = t;
+                // the brush may have painted over the body since the last step, or a pushed particle
+                // may have taken the cell
+                if (_cellTypes[CellIndex(x, y)] != t_body)
+                    continue;
+                ReplaceCell(CellIndex(x, y), t_air);
+                _stats.bodyCells++;
             }
-            else
+        }
+    }
+    for (int y = first; y < last; y++)
+    {
+        int n = SpanDifference(SpanAtRow(top, spans, y), SpanAtRow(body.top, body.spans, y), diff);
+        for (int i = 0; i < n; i++)
+        {
+            for (int x = diff[i].x0; x <= diff[i].x1; x++)
             {
+                ReplaceCell(CellIndex(x, y), t_body);
+                _particles[CellIndex(x, y)]->setColor(body.color);
+                _stats.bodyCells++;
+            }
+        }
+    }
+    body.top = top;
+    body.spans = spans;
+    return true;
+}
+
+// moves whatever is at (x, y) out of the new footprint; a powder may sink into water, which is then
+// pushed on in turn, so this can take a few rounds. False if something is left without room
+bool ParticleWorld::PushParticle(RigidBody &body, int x, int y, int pushX, int pushY, int top, const std::vector<BodySpan> &spans)
+{
+    // done once the cell holds air or, after a swap into the uncovered part of the old footprint, a
+    // cell of the body, which is about to be covered again anyway
+    int idx = CellIndex(x, y);
+    for (int round = 0; round < MAT_COUNT; round++)
+    {
+        if (_cellTypes[idx] == t_air || _cellTypes[idx] == t_body)
+            return true;
+        int target = FindPushTarget(body, x, y, pushX, pushY, top, spans);
+        if (target < 0)
+            return false;
+        SwapParticles(idx, target);
+        _pushSwaps.emplace_back(idx, target);
+    }
+    return false;
+}
+
+// a cell outside the new footprint that can take the particle: air, a liquid it sinks into, or a cell
+// of the body's old footprint that the move uncovers
+bool ParticleWorld::TakesPushed(RigidBody &body, Mat_Type mover, int x, int y, int top, const std::vector<BodySpan> &spans)
+{
+    BodySpan span = SpanAtRow(top, spans, y);
+    if (x >= span.x0 && x <= span.x1)
+        return false;
+    Mat_Type type = _cellTypes[CellIndex(x, y)];
+    if (type == t_body)
+    {
+        BodySpan old = SpanAtRow(body.top, body.spans, y);
+        return x >= old.x0 && x <= old.x1;
+    }
+    return type == t_air || ((_liquidMask & MAT_MASK(type)) && (_enterMask[mover] & MAT_MASK(type)));
+}
+
+// first along the push direction, which keeps material moving with the body, then straight up to the
+// first static cell, which lets a sinking body displace a deep pool onto its surface, then the nearest
+// cell within BODY_PUSH_RANGE reachable through anything but static cells; -1 if there is none
+int ParticleWorld::FindPushTarget(RigidBody &body, int x, int y, int pushX, int pushY, int top, const std::vector<BodySpan> &spans)
+{
+    Mat_Type mover = _cellTypes[CellIndex(x, y)];
+    int directions[2][2] = {{pushX, pushY}, {0, -1}};
+    for (auto &d : directions)
+    {
+        if (d[0] == 0 && d[1] == 0)
+            continue;
+        int cx = x;
+        int cy = y;
+        int range = d[0] == 0 && d[1] == -1 ? y : BODY_PUSH_RANGE;
+        for (int i = 0; i < range; i++)
+        {
+            cx += d[0];
+            cy += d[1];
+            if (!InBounds(cx, cy))
                 break;
+            if (TakesPushed(body, mover, cx, cy, top, spans))
+                return CellIndex(cx, cy);
+            BodySpan span = SpanAtRow(top, spans, cy);
+            if (materialInfo[_cellTypes[CellIndex(cx, cy)]].move == move_static && !(cx >= span.x0 && cx <= span.x1))
+                break;
+        }
+    }
+
+    // breadth-first over the box around (x, y); cells of the body itself are passed through
+    int side = 2 * BODY_PUSH_RANGE + 1;
+    if ((int)_pushVisit.size() != side * side)
+        _pushVisit.assign(side * side, 0);
+    if (++_pushSearch == 0)
+    {
+        std::fill(_pushVisit.begin(), _pushVisit.end(), 0);
+        _pushSearch = 1;
+    }
+    _pushQueue.clear();
+    _pushQueue.push_back(BODY_PUSH_RANGE * side + BODY_PUSH_RANGE);
+    _pushVisit[_pushQueue[0]] = _pushSearch;
+    for (size_t q = 0; q < _pushQueue.size(); q++)
+    {
+        int lx = _pushQueue[q] % side;
+        int ly = _pushQueue[q] / side;
+        int neighbours[4][2] = {{lx, ly - 1}, {lx - 1, ly}, {lx + 1, ly}, {lx, ly + 1}};
+        for (auto &n : neighbours)
+        {
+            int cx = x + n[0] - BODY_PUSH_RANGE;
+            int cy = y + n[1] - BODY_PUSH_RANGE;
+            if (n[0] < 0 || n[0] >= side || n[1] < 0 || n[1] >= side || !InBounds(cx, cy))
+                continue;
+            int local = n[1] * side + n[0];
+            if (_pushVisit[local] == _pushSearch)
+                continue;
+            _pushVisit[local] = _pushSearch;
+            if (TakesPushed(body, mover, cx, cy, top, spans))
+                return CellIndex(cx, cy);
+            BodySpan old = SpanAtRow(body.top, body.spans, cy);
+            bool ownCell = _cellTypes[CellIndex(cx, cy)] == t_body && cx >= old.x0 && cx <= old.x1;
+            if (materialInfo[_cellTypes[CellIndex(cx, cy)]].move != move_static || ownCell)
+                _pushQueue.push_back(local);
+        }
+    }
+    return -1;
+}
+
+long ParticleWorld::ApplyImpulse(int x, int y, int radius, float strength)
+{
+    TRACE_SCOPE("ApplyImpulse");
+    long affected = 0;
+    radius = std::max(radius, 1);
+    float invRadius = 1.0f / radius;
+    for (int oy = -radius; oy <= radius; oy++)
+    {
+        int row = y + oy;
+        if (row < _ownedTop || row > _ownedBottom)
+            continue;
+        int half = (int)std::sqrt((double)(radius * radius - oy * oy));
+        int x0 = std::max(x - half, 0);
+        int x1 = std::min(x + half, _width - 1);
+        if (x0 > x1)
+            continue;
+        // the radial field of a row is computed in one pass over plain arrays, then added to the movers in it
+        int count = x1 - x0 + 1;
+        _impulseX.resize(count);
+        _impulseY.resize(count);
+        float dy = (float)oy;
+        for (int i = 0; i < count; i++)
+        {
+            float dx = (float)(x0 + i - x);
+            float distance = std::sqrt(dx * dx + dy * dy);
+            float scale = strength * std::max(0.0f, 1.0f - distance * invRadius) / (distance + 1e-3f);
+            _impulseX[i] = dx * scale;
+            _impulseY[i] = dy * scale;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            // gases keep their own velocity convention and are left alone
+            int idx = CellIndex(x0 + i, row);
+            MoveKind move = materialInfo[_cellTypes[idx]].move;
+            if (move != move_powder && move != move_liquid)
+                continue;
+            Particle *p = _particles[idx];
+            Vector2 vel = p->getVelocity();
+            p->setVelocity(Vector2{vel.x + _impulseX[i], vel.y + _impulseY[i]});
+            affected++;
+        }
+    }
+    for (RigidBody &body : _bodies)
+    {
+        float dx = body.position.x - x;
+        float dy = body.position.y - y;
+        float distance = std::sqrt(dx * dx + dy * dy);
+        if (distance >= radius + body.radius)
+            continue;
+        float scale = strength * std::max(0.1f, 1.0f - distance * invRadius) / (distance + 1e-3f);
+        body.velocity.x += dx * scale;
+        body.velocity.y += dy * scale;
+        body.angularVelocity += (dx >= 0.0f ? 0.05f : -0.05f) * strength / std::max(body.radius, 1.0f);
+    }
+    return affected;
+}
+
+void ParticleWorld::Eject(int idx)
+{
+    Particle *p = _particles[idx];
+    Vector2 vel = p->getVelocity();
+    _flying.Add(CellX(idx) + 0.5f, CellY(idx) + 0.5f, vel.x, vel.y, _cellTypes[idx], p->getColor(), p->getLife());
+    ReplaceCell(idx, t_air);
+    _stats.ejected++;
+}
+
+// integrates the flying particles and walks each one's path through the grid; a particle that hits
+// anything but air or gas, or has slowed down, is written back into the last open cell it reached
+void ParticleWorld::StepFlying()
+{
+    if (_flying.size() == 0)
+        return;
+    ScopedTimer flyingTimer(_profiler, phase_flying);
+    TRACE_SCOPE("StepFlying");
+    _flying.Integrate((float)(GRAVITY * _deltaTime), FLY_DRAG);
+    for (int i = 0; i < _flying.size(); i++)
+    {
+        int x0 = (int)std::floor(_flying.getPrevX(i));
+        int y0 = (int)std::floor(_flying.getPrevY(i));
+        int x1 = (int)std::floor(_flying.getX(i));
+        int y1 = (int)std::floor(_flying.getY(i));
+        int landX;
+        int landY;
+        TraceMove(x0, y0, x1 - x0, y1 - y0, _openMask, landX, landY);
+        bool blocked = landX != x1 || landY != y1;
+        float vx = _flying.getVelocityX(i);
+        float vy = _flying.getVelocityY(i);
+        if (!blocked && vx * vx + vy * vy >= FLY_SETTLE_SPEED * FLY_SETTLE_SPEED)
+        {
+            // in a strip, a particle flying on past the owned rows is handed to the neighbour that owns them
+            if ((y1 < _ownedTop && _ownedTop > 0) || (y1 > _ownedBottom && _ownedBottom < _height - 1))
+                HandOverFlying(i--, x1, y1, vx, vy);
+            continue;
+        }
+        // lands in air only, so gases it passed through are not overwritten; the cell may have filled up
+        // since the particle passed it, and with no air in the column it waits in flight for room, in the
+        // strip above when there is one
+        if (!PlaceParticle(landX, landY, MAT_MASK(t_air), _flying.getType(i), _flying.getColor(i), _flying.getLife(i),
+                           Vector2{0.0f, blocked ? 1.0f : std::max(vy, 1.0f)}))
+        {
+            _stats.unlanded++;
+            if (_ownedTop > 0)
+                HandOverFlying(i--, landX, _ownedTop - 1, 0.0f, 0.0f);
+            else
+                _flying.Stop(i, landX + 0.5f, landY + 0.5f);
+            continue;
+        }
+        _stats.landed++;
+        _flying.Remove(i);
+        i--;
+    }
+}
+
+void ParticleWorld::HandOverFlying(int i, int x, int y, float vx, float vy)
+{
+    Migration m = {std::min(std::max(x, 0), _width - 1), y, x, y, _flying.getType(i), t_air, false,
+                   _flying.getColor(i), Vector2{vx, vy}, _flying.getLife(i), true};
+    _outbox.push_back(m);
+    _stats.migrated++;
+    _flying.Remove(i);
+}
+
+bool ParticleWorld::PlaceParticle(int x, int y, unsigned into, Mat_Type type, Color color, int life, Vector2 velocity)
+{
+    // search up and down until static cells close both ways, from the nearest owned row, so a particle
+    // that flew out of a strip comes down inside it
+    y = std::min(std::max(y, _ownedTop), _ownedBottom);
+    bool upOpen = true;
+    bool downOpen = true;
+    for (int d = 0; d < _height && (upOpen || downOpen); d++)
+    {
+        int ys[2] = {y - d, y + d};
+        bool *open[2] = {&upOpen, &downOpen};
+        int idx = -1;
+        for (int k = 0; k < 2 && idx < 0; k++)
+        {
+            if (!*open[k] || ys[k] < _ownedTop || ys[k] > _ownedBottom)
+            {
+                *open[k] = false;
+                continue;
             }
+            Mat_Type cell = _cellTypes[CellIndex(x, ys[k])];
+            if (materialInfo[cell].move == move_static)
+                *open[k] = false;
+            else if (into & MAT_MASK(cell))
+                idx = CellIndex(x, ys[k]);
         }
-        MoveParticle(x, y, dstX, y);
+        if (idx < 0)
+            continue;
+        ReplaceCell(idx, type);
+        Particle *p = _particles[idx];
+        p->setColor(color);
+        p->setLife(life);
+        p->setVelocity(velocity);
+        return true;
     }
+    return false;
 }
 
-void ParticleWorld::MoveParticle(int x1, int y1, int x2, int y2)
+void ParticleWorld::setOwnedRows(int top, int bottom)
 {
-    _frameSwaps.emplace_back(CoordToIndex(x1, y1), CoordToIndex(x2, y2));
+    _ownedTop = std::max(top, 0);
+    _ownedBottom = std::min(bottom, _height - 1);
 }
 
-void ParticleWorld::SwapParticles(int x1, int y1, int x2, int y2)
+void ParticleWorld::setFocus(Rectangle focus, int farInterval)
 {
-    Particle *tmp = ParticleAtCoord(x1, y1);
-    _particles[CoordToIndex(x1, y1)] = ParticleAtCoord(x2, y2);
-    _particles[CoordToIndex(x2, y2)] = tmp;
+    _focus = focus;
+    _farInterval = std::max(farInterval, 1);
+    if (_farInterval == 1)
+        std::fill(_chunkSkip.begin(), _chunkSkip.end(), 0);
 }
 
-void ParticleWorld::SwapParticles(int id1, int id2)
+void ParticleWorld::Emigrate(int src, int dst)
 {
-    Particle *tmp = ParticleAtIndex(id1);
-    _particles[id1] = ParticleAtIndex(id2);
-    _particles[id2] = tmp;
+    // swap with the halo copy so the source cell gets what the mover displaced, as in a local move
+    SwapParticles(src, dst);
+    Particle *p = _particles[dst];
+    _outbox.push_back(Migration{CellX(dst), CellY(dst), CellX(src), CellY(src), (unsigned char)_cellTypes[dst],
+                                (unsigned char)_cellTypes[src], false, p->getColor(), p->getVelocity(), p->getLife()});
+    _stats.migrated++;
+}
+
+bool ParticleWorld::ReceiveMigration(const Migration &m)
+{
+    if (m.flying)
+    {
+        _flying.Add(m.x + 0.5f, m.y + 0.5f, m.velocity.x, m.velocity.y, m.type, m.color, m.life);
+        return true;
+    }
+    if (m.x < 0 || m.x >= _width || m.y < _ownedTop || m.y > _ownedBottom)
+        return false;
+    // the target cell may have changed since the sender saw it; any cell of the displaced type in the column will do
+    return PlaceParticle(m.x, m.y, MAT_MASK(m.displaced), m.type, m.color, m.life, m.velocity);
+}
+
+void ParticleWorld::ReadRow(int y, unsigned char *types, Color *colors)
+{
+    for (int x = 0; x < _width; x++)
+    {
+        int idx = CellIndex(x, y);
+        types[x] = _cellTypes[idx];
+        colors[x] = _particles[idx]->getColor();
+    }
+}
+
+void ParticleWorld::WriteRow(int y, const unsigned char *types, const Color *colors)
+{
+    for (int x = 0; x < _width; x++)
+    {
+        int idx = CellIndex(x, y);
+        if (_cellTypes[idx] != types[x])
+            ReplaceCell(idx, types[x]);
+        BeforeWrite(idx);
+        _particles[idx]->setColor(colors[x]);
+    }
+}
+
+void ParticleWorld::CaptureChunk(int chunk, ChunkImage &image)
+{
+    Rectangle bounds = ChunkBounds(chunk);
+    image.chunk = chunk;
+    image.x = (int)bounds.x;
+    image.y = (int)bounds.y;
+    image.width = (int)bounds.width;
+    image.height = (int)bounds.height;
+    int cells = image.width * image.height;
+    image.types.resize(cells);
+    image.colors.resize(cells);
+    image.life.resize(cells);
+    for (int y = 0; y < image.height; y++)
+    {
+        int idx = CellIndex(image.x, image.y + y); // a chunk's rows are contiguous in either layout
+        int out = y * image.width;
+        std::copy(&_cellTypes[idx], &_cellTypes[idx] + image.width, &image.types[out]);
+        for (int x = 0; x < image.width; x++)
+        {
+            Particle *p = _particles[idx + x];
+            image.colors[out + x] = p->getColor();
+            image.life[out + x] = p->getLife();
+        }
+    }
+}
+
+void ParticleWorld::RestoreChunk(const ChunkImage &image)
+{
+    for (int y = 0; y < image.height; y++)
+    {
+        for (int x = 0; x < image.width; x++)
+        {
+            int idx = CellIndex(image.x + x, image.y + y);
+            int in = y * image.width + x;
+            if (_cellTypes[idx] != image.types[in])
+                ReplaceCell(idx, image.types[in]);
+            BeforeWrite(idx);
+            Particle *p = _particles[idx];
+            p->setColor(image.colors[in]);
+            p->setLife(image.life[in]);
+        }
+    }
+    MarkDirty(image.x, image.y);
+}
+
+const unsigned char *ParticleWorld::RowMajorTypes()
+{
+#ifdef GRID_TILED
+    _rowMajorTypes.resize(_width * _height);
+    for (int y = 0; y < _height; y++)
+    {
+        for (int x = 0; x < _width; x += CHUNK_SIZE)
+        {
+            const unsigned char *types = &_cellTypes[CellIndex(x, y)];
+            std::copy(types, types + std::min(CHUNK_SIZE, _width - x), &_rowMajorTypes[y * _width + x]);
+        }
+    }
+    return _rowMajorTypes.data();
+#else
+    return _cellTypes.data();
+#endif
+}
+
+void ParticleWorld::CopyChunkOnWrite(int chunk)
+{
+    for (CowEpoch *epoch : _epochs)
+    {
+        if (epoch->BeforeWrite(chunk))
+        {
+            CaptureChunk(chunk, epoch->Image(chunk));
+            epoch->Copied(chunk);
+        }
+    }
+}
+
+Rectangle ParticleWorld::ChunkBounds(int chunk)
+{
+    int x = (chunk % _chunksX) * CHUNK_SIZE;
+    int y = (chunk / _chunksX) * CHUNK_SIZE;
+    return Rectangle{(float)x, (float)y, (float)std::min(CHUNK_SIZE, _width - x), (float)std::min(CHUNK_SIZE, _height - y)};
+}
+
+void ParticleWorld::MarkDirty(int x, int y)
+{
+    MarkChunkDirty(ChunkIndex(x, y));
+}
+
+void ParticleWorld::MarkDirty(int idx)
+{
+    MarkChunkDirty(ChunkOfCell(idx));
+}
+
+void ParticleWorld::MarkChunkDirty(int chunk)
+{
+    if (!_chunkDirty[chunk])
+    {
+        _chunkDirty[chunk] = 1;
+        _damagedChunks.push_back(chunk);
+    }
+}
+
+void ParticleWorld::MarkAllDirty()
+{
+    for (int i = 0; i < _chunksX * _chunksY; i++)
+    {
+        if (!_chunkDirty[i])
+        {
+            _chunkDirty[i] = 1;
+            _damagedChunks.push_back(i);
+        }
+    }
+}
+
+void ParticleWorld::CollectDamageRects(std::vector<Rectangle> &rects)
+{
+    rects.clear();
+    std::sort(_damagedChunks.begin(), _damagedChunks.end());
+    for (int i = 0; i < (int)_damagedChunks.size(); i++)
+    {
+        int first = _damagedChunks[i];
+        int last = first;
+        // extend over horizontally adjacent dirty chunks in the same chunk row
+        while (i + 1 < (int)_damagedChunks.size() && _damagedChunks[i + 1] == last + 1 && (last + 1) % _chunksX != 0)
+            last = _damagedChunks[++i];
+        Rectangle a = ChunkBounds(first);
+        Rectangle b = ChunkBounds(last);
+        rects.push_back(Rectangle{a.x, a.y, b.x + b.width - a.x, a.height});
+    }
+    for (int chunk : _damagedChunks)
+        _chunkDirty[chunk] = 0;
+    _damagedChunks.clear();
+}
+
+Particle *MakeParticle(Mat_Type type)
+{
+    Particle *p;
+    switch (type)
+    {
+    case t_solid:
+        p = new Particle{t_solid, color_solid()};
+        break;
+    case t_sand:
+        p = new Particle{t_sand, color_sand()};
+        break;
+    case t_water:
+        p = new Particle{t_water, color_water()};
+        break;
+    case t_glass:
+        p = new Particle{t_glass, color_glass()};
+        break;
+    case t_steam:
+        p = new Particle{t_steam, color_steam()};
+        break;
+    case t_fire:
+        p = new Particle{t_fire, color_fire()};
+        break;
+    case t_wood:
+        p = new Particle{t_wood, color_wood()};
+        break;
+    case t_body:
+        p = new Particle{t_body, color_body()};
+        break;
+    default:
+        return new Particle{t_air, color_air()};
+    }
+    // lifetimes are spread out so a burst of fire or steam does not vanish in one step
+    if (materialInfo[type].lifetime > 0)
+        p->setLife((int)(materialInfo[type].lifetime * randomBetween(0.5, 1.5)) + 1);
+    return p;
 }
 
 double randomBetween(double a, double b)
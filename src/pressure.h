@@ -0,0 +1,150 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+#define PRESSURE_CELL 8 // world cells per side of one pressure cell
+
+// Hydraulic head of the water on a coarse grid. Cells holding water and air are pinned to the height
+// of their water line; fully submerged cells relax towards the mean of their wet neighbours (Jacobi),
+// so the head field carries pressure through connected water without per-particle steps.
+class PressureField
+{
+public:
+    void Resize(int width, int height);
+    void Build(const unsigned char *types, unsigned char waterType, unsigned char airType);
+    void Solve(int iterations);
+    float HeadAt(int x, int y) { return _head[Index(x / PRESSURE_CELL, y / PRESSURE_CELL)]; }
+    bool IsWet(int x, int y) { return _wet[Index(x / PRESSURE_CELL, y / PRESSURE_CELL)] != 0; }
+    float GradientX(int x, int y); // head change per pressure cell towards +x, 0 where the neighbours are dry
+    int const getCoarseWidth() { return _cw; }
+    int const getCoarseHeight() { return _ch; }
+
+private:
+    int Index(int cx, int cy) { return (cy + 1) * _stride + (cx + 1); } // one cell of padding on every side
+    int _width = 0;
+    int _height = 0;
+    int _cw = 0;
+    int _ch = 0;
+    int _stride = 0;
+    std::vector<int> _waterCount;
+    std::vector<int> _airCount;
+    std::vector<unsigned char> _wet;
+    // per-cell stencil coefficients; branch-free so the sweep vectorizes
+    std::vector<float> _head;
+    std::vector<float> _next;
+    std::vector<float> _pinned;  // 1 where the head is fixed to the water line
+    std::vector<float> _pinnedHead;
+    std::vector<float> _wLeft, _wRight, _wUp, _wDown;
+    std::vector<float> _invCount;
+};
+
+void PressureField::Resize(int width, int height)
+{
+    _width = width;
+    _height = height;
+    _cw = (width + PRESSURE_CELL - 1) / PRESSURE_CELL;
+    _ch = (height + PRESSURE_CELL - 1) / PRESSURE_CELL;
+    _stride = _cw + 2;
+    int size = _stride * (_ch + 2);
+    _waterCount.assign(_cw * _ch, 0);
+    _airCount.assign(_cw * _ch, 0);
+    _wet.assign(size, 0);
+    _head.assign(size, 0.0f);
+    _next.assign(size, 0.0f);
+    _pinned.assign(size, 1.0f);
+    _pinnedHead.assign(size, 0.0f);
+    _wLeft.assign(size, 0.0f);
+    _wRight.assign(size, 0.0f);
+    _wUp.assign(size, 0.0f);
+    _wDown.assign(size, 0.0f);
+    _invCount.assign(size, 0.0f);
+}
+
+void PressureField::Build(const unsigned char *types, unsigned char waterType, unsigned char airType)
+{
+    std::fill(_waterCount.begin(), _waterCount.end(), 0);
+    std::fill(_airCount.begin(), _airCount.end(), 0);
+    for (int y = 0; y < _height; y++)
+    {
+        const unsigned char *row = types + y * _width;
+        int *water = &_waterCount[(y / PRESSURE_CELL) * _cw];
+        int *air = &_airCount[(y / PRESSURE_CELL) * _cw];
+        for (int x = 0; x < _width; x++)
+        {
+            water[x / PRESSURE_CELL] += row[x] == waterType;
+            air[x / PRESSURE_CELL] += row[x] == airType;
+        }
+    }
+
+    for (int cy = 0; cy < _ch; cy++)
+    {
+        for (int cx = 0; cx < _cw; cx++)
+        {
+            int water = _waterCount[cy * _cw + cx];
+            _wet[Index(cx, cy)] = water > 0;
+        }
+    }
+
+    for (int cy = 0; cy < _ch; cy++)
+    {
+        for (int cx = 0; cx < _cw; cx++)
+        {
+            int i = Index(cx, cy);
+            int water = _waterCount[cy * _cw + cx];
+            int air = _airCount[cy * _cw + cx];
+            // elevation measured upwards from the bottom of the world, in world cells
+            float bottom = (float)(_height - std::min((cy + 1) * PRESSURE_CELL, _height));
+            _wLeft[i] = _wet[i - 1];
+            _wRight[i] = _wet[i + 1];
+            _wUp[i] = _wet[i - _stride];
+            _wDown[i] = _wet[i + _stride];
+            float count = _wLeft[i] + _wRight[i] + _wUp[i] + _wDown[i];
+            _invCount[i] = count > 0.0f ? 1.0f / count : 0.0f;
+            if (!_wet[i])
+            {
+                _pinned[i] = 1.0f;
+                _pinnedHead[i] = 0.0f;
+                _head[i] = 0.0f;
+            }
+            else if (air > 0 || count == 0.0f)
+            {
+                _pinned[i] = 1.0f;
+                _pinnedHead[i] = bottom + (float)PRESSURE_CELL * water / (float)(water + air);
+            }
+            else
+            {
+                _pinned[i] = 0.0f;
+                _pinnedHead[i] = 0.0f;
+                if (_head[i] == 0.0f)
+                    _head[i] = bottom + PRESSURE_CELL; // first time wet: start at the cell top
+            }
+        }
+    }
+}
+
+void PressureField::Solve(int iterations)
+{
+    int first = _stride + 1;
+    int last = _stride * (_ch + 1) - 1;
+    for (int it = 0; it < iterations; it++)
+    {
+        const float *h = _head.data();
+        float *out = _next.data();
+        for (int i = first; i < last; i++)
+        {
+            float relaxed = (_wLeft[i] * h[i - 1] + _wRight[i] * h[i + 1] + _wUp[i] * h[i - _stride] + _wDown[i] * h[i + _stride]) * _invCount[i];
+            out[i] = _pinned[i] * _pinnedHead[i] + (1.0f - _pinned[i]) * relaxed;
+        }
+        _head.swap(_next);
+    }
+}
+
+float PressureField::GradientX(int x, int y)
+{
+    int i = Index(x / PRESSURE_CELL, y / PRESSURE_CELL);
+    if (!_wet[i])
+        return 0.0f;
+    float left = _wet[i - 1] ? _head[i - 1] : _head[i];
+    float right = _wet[i + 1] ? _head[i + 1] : _head[i];
+    return (right - left) * 0.5f;
+}
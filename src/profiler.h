@@ -0,0 +1,182 @@
+#pragma once
+#include <raylib.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+enum ProfilePhase
+{
+    phase_update = 0,
+    phase_bodies,
+    phase_flying,
+    phase_pressure,
+    phase_scan,
+    phase_commit_filter,
+    phase_commit_sort,
+    phase_commit_apply,
+    phase_equalize,
+    phase_thermal,
+    phase_brush,
+    phase_draw,
+    phase_present,
+    phase_frame,
+    phase_count
+};
+
+static const char *phaseNames[phase_count] = {
+    "update", "bodies", "flying", "pressure", "scan", "commit_filter", "commit_sort", "commit_apply", "equalize", "thermal", "brush", "draw", "present", "frame"};
+
+// collects per-phase timings for each frame and keeps a rolling window for percentiles
+class FrameProfiler
+{
+public:
+    FrameProfiler(int windowSize = 240);
+    ~FrameProfiler();
+    void BeginFrame();
+    void EndFrame();
+    void AddSample(ProfilePhase phase, double seconds) { _current[phase] += seconds; }
+    double Percentile(ProfilePhase phase, double p); // p in [0, 1], result in milliseconds
+    double Average(ProfilePhase phase);              // milliseconds
+    void DrawOverlay(int x, int y);
+    bool StartCsv(const std::string &path);
+    void StopCsv();
+    bool const isRecording() { return _csv.is_open(); }
+    bool const isOverlayVisible() { return _showOverlay; }
+    void setOverlayVisible(bool visible) { _showOverlay = visible; }
+
+private:
+    std::vector<double> _samples[phase_count]; // ring buffer per phase, in seconds
+    std::vector<double> _scratch;
+    double _current[phase_count];
+    std::chrono::steady_clock::time_point _frameStart;
+    int _windowSize;
+    int _head = 0;
+    int _filled = 0;
+    long _frameIndex = 0;
+    bool _showOverlay = false;
+    std::ofstream _csv;
+};
+
+// times the enclosing scope into the given phase; does nothing when profiler is null
+class ScopedTimer
+{
+public:
+    ScopedTimer(FrameProfiler *profiler, ProfilePhase phase) : _profiler(profiler), _phase(phase)
+    {
+        if (_profiler)
+            _start = std::chrono::steady_clock::now();
+    }
+    ~ScopedTimer() { Stop(); }
+    void Stop() // ends the measurement early, for sequential phases in one scope
+    {
+        if (_profiler)
+            _profiler->AddSample(_phase, std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count());
+        _profiler = nullptr;
+    }
+
+private:
+    FrameProfiler *_profiler;
+    ProfilePhase _phase;
+    std::chrono::steady_clock::time_point _start;
+};
+
+FrameProfiler::FrameProfiler(int windowSize)
+{
+    _windowSize = windowSize;
+    for (int i = 0; i < phase_count; i++)
+    {
+        _samples[i].assign(windowSize, 0.0);
+        _current[i] = 0.0;
+    }
+    _scratch.reserve(windowSize);
+    _frameStart = std::chrono::steady_clock::now();
+}
+
+FrameProfiler::~FrameProfiler()
+{
+    StopCsv();
+}
+
+void FrameProfiler::BeginFrame()
+{
+    for (int i = 0; i < phase_count; i++)
+        _current[i] = 0.0;
+    _frameStart = std::chrono::steady_clock::now();
+}
+
+void FrameProfiler::EndFrame()
+{
+    _current[phase_frame] = std::chrono::duration<double>(std::chrono::steady_clock::now() - _frameStart).count();
+    for (int i = 0; i < phase_count; i++)
+        _samples[i][_head] = _current[i];
+    _head = (_head + 1) % _windowSize;
+    _filled = std::min(_filled + 1, _windowSize);
+
+    if (_csv.is_open())
+    {
+        _csv << _frameIndex;
+        for (int i = 0; i < phase_count; i++)
+            _csv << ',' << _current[i] * 1000.0;
+        _csv << '\n';
+    }
+    _frameIndex++;
+}
+
+double FrameProfiler::Percentile(ProfilePhase phase, double p)
+{
+    if (_filled == 0)
+        return 0.0;
+    _scratch.assign(_samples[phase].begin(), _samples[phase].begin() + _filled);
+    int k = std::min((int)(p * (_filled - 1) + 0.5), _filled - 1);
+    std::nth_element(_scratch.begin(), _scratch.begin() + k, _scratch.end());
+    return _scratch[k] * 1000.0;
+}
+
+double FrameProfiler::Average(ProfilePhase phase)
+{
+    if (_filled == 0)
+        return 0.0;
+    double sum = 0.0;
+    for (int i = 0; i < _filled; i++)
+        sum += _samples[phase][i];
+    return sum / _filled * 1000.0;
+}
+
+void FrameProfiler::DrawOverlay(int x, int y)
+{
+    if (!_showOverlay)
+        return;
+    const int lineHeight = 16;
+    DrawRectangle(x - 5, y - 5, 390, lineHeight * (phase_count + 1) + 10, Fade(BLACK, 0.7f));
+    DrawText("phase            avg    p50    p95    p99 (ms)", x, y, 10, RAYWHITE);
+    for (int i = 0; i < phase_count; i++)
+    {
+        ProfilePhase phase = (ProfilePhase)i;
+        DrawText(TextFormat("%-14s %6.2f %6.2f %6.2f %6.2f", phaseNames[i], Average(phase),
+                            Percentile(phase, 0.5), Percentile(phase, 0.95), Percentile(phase, 0.99)),
+                 x, y + lineHeight * (i + 1), 10, i == phase_frame ? YELLOW : LIME);
+    }
+    if (_csv.is_open())
+        DrawText("REC", x + 350, y, 10, RED);
+}
+
+bool FrameProfiler::StartCsv(const std::string &path)
+{
+    StopCsv();
+    _csv.open(path);
+    if (!_csv.is_open())
+        return false;
+    _csv << "frame";
+    for (int i = 0; i < phase_count; i++)
+        _csv << ',' << phaseNames[i] << "_ms";
+    _csv << '\n';
+    return true;
+}
+
+void FrameProfiler::StopCsv()
+{
+    if (_csv.is_open())
+        _csv.close();
+}
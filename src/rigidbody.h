@@ -0,0 +1,108 @@
+#pragma once
+#include <raylib.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#define BODY_MAX_SPEED 6.0f // cells per step
+#define BODY_PUSH_RANGE 64  // how far a displaced particle is carried looking for a free cell
+
+// one row of a rasterized body; x1 < x0 means the row is empty
+struct BodySpan
+{
+    int x0;
+    int x1; // inclusive
+};
+
+// convex polygon moving through the world; its footprint is written into the grid as t_body cells
+struct RigidBody
+{
+    std::vector<Vector2> shape;   // vertices around the centre, in cells
+    Vector2 position = {0, 0};    // centre, in cells
+    float angle = 0.0f;           // radians
+    Vector2 velocity = {0, 0};    // cells per step
+    float angularVelocity = 0.0f; // radians per step
+    float radius = 0.0f;          // distance of the farthest vertex from the centre
+    Color color = GRAY;
+    int top = 0; // row of spans[0]
+    std::vector<BodySpan> spans;
+};
+
+std::vector<Vector2> BoxShape(float width, float height);
+// scanline fill of a convex shape at a pose, sampled at cell centres; spans[i] covers row top + i
+void RasterizeConvex(const std::vector<Vector2> &shape, Vector2 position, float angle, int &top, std::vector<BodySpan> &spans);
+BodySpan SpanAtRow(int top, const std::vector<BodySpan> &spans, int y);
+int SpanDifference(BodySpan a, BodySpan b, BodySpan out[2]); // cells of a not in b, as up to two spans
+
+std::vector<Vector2> BoxShape(float width, float height)
+{
+    float hw = width * 0.5f;
+    float hh = height * 0.5f;
+    return std::vector<Vector2>{{-hw, -hh}, {hw, -hh}, {hw, hh}, {-hw, hh}};
+}
+
+void RasterizeConvex(const std::vector<Vector2> &shape, Vector2 position, float angle, int &top, std::vector<BodySpan> &spans)
+{
+    spans.clear();
+    if (shape.size() < 3)
+        return;
+    float c = std::cos(angle);
+    float s = std::sin(angle);
+    Vector2 points[32];
+    int count = std::min((int)shape.size(), 32);
+    float minY = 1e30f;
+    float maxY = -1e30f;
+    for (int i = 0; i < count; i++)
+    {
+        points[i] = Vector2{position.x + shape[i].x * c - shape[i].y * s, position.y + shape[i].x * s + shape[i].y * c};
+        minY = std::min(minY, points[i].y);
+        maxY = std::max(maxY, points[i].y);
+    }
+    top = (int)std::ceil(minY - 0.5f);
+    int bottom = (int)std::floor(maxY - 0.5f);
+    for (int y = top; y <= bottom; y++)
+    {
+        float sampleY = y + 0.5f;
+        float xMin = 1e30f;
+        float xMax = -1e30f;
+        for (int i = 0; i < count; i++)
+        {
+            Vector2 a = points[i];
+            Vector2 b = points[(i + 1) % count];
+            if ((a.y <= sampleY && sampleY < b.y) || (b.y <= sampleY && sampleY < a.y))
+            {
+                float x = a.x + (sampleY - a.y) * (b.x - a.x) / (b.y - a.y);
+                xMin = std::min(xMin, x);
+                xMax = std::max(xMax, x);
+            }
+        }
+        if (xMin > xMax)
+            spans.push_back(BodySpan{0, -1});
+        else
+            spans.push_back(BodySpan{(int)std::ceil(xMin - 0.5f), (int)std::floor(xMax - 0.5f)});
+    }
+}
+
+BodySpan SpanAtRow(int top, const std::vector<BodySpan> &spans, int y)
+{
+    if (y < top || y >= top + (int)spans.size())
+        return BodySpan{0, -1};
+    return spans[y - top];
+}
+
+int SpanDifference(BodySpan a, BodySpan b, BodySpan out[2])
+{
+    if (a.x1 < a.x0)
+        return 0;
+    if (b.x1 < b.x0 || b.x1 < a.x0 || b.x0 > a.x1)
+    {
+        out[0] = a;
+        return 1;
+    }
+    int n = 0;
+    if (a.x0 < b.x0)
+        out[n++] = BodySpan{a.x0, b.x0 - 1};
+    if (a.x1 > b.x1)
+        out[n++] = BodySpan{b.x1 + 1, a.x1};
+    return n;
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include <cstdlib>
+#include <cstring>
+#include "particle.h"
+
+// Canned worlds used by the benchmark suite and the number keys in the interactive build.
+// Every scenario is generated from std::rand, so seeding with std::srand makes a run reproducible.
+
+enum Scenario
+{
+    scenario_sand_avalanche = 0,
+    scenario_water_tank_fill,
+    scenario_sand_into_water,
+    scenario_full_world_rain,
+    scenario_mostly_settled,
+    scenario_solid_maze,
+    scenario_heated_sand,
+    scenario_body_drop,
+    scenario_explosions,
+    scenario_count
+};
+
+static const char *scenarioNames[scenario_count] = {
+    "sand_avalanche", "water_tank_fill", "sand_into_water", "full_world_rain", "mostly_settled", "solid_maze", "heated_sand", "body_drop", "explosions"};
+
+// builds the initial state of a scenario into an empty world. As in StepScenario, the world may hold only
+// the scenario's rows from top down and then only gets its owned rows
+void BuildScenario(ParticleWorld &world, Scenario scenario, int width, int height, int top = 0)
+{
+    world.ClearBodies();
+    world.ClearFlying();
+    world.FillRect(0, 0 - top, width - 1, height - 1 - top, t_air);
+    switch (scenario)
+    {
+    case scenario_sand_avalanche:
+    {
+        // a block of sand on a shelf that ends halfway across the world
+        world.FillRect(0, height / 2 - top, width / 2, height / 2 + 1 - top, t_solid);
+        world.FillRect(0, height / 8 - top, width * 3 / 8, height / 2 - 1 - top, t_sand);
+        break;
+    }
+    case scenario_water_tank_fill:
+    {
+        world.FillRect(width / 4, height - 2 - top, width * 3 / 4, height - 1 - top, t_solid);
+        world.FillRect(width / 4, height / 3 - top, width / 4 + 1, height - 1 - top, t_solid);
+        world.FillRect(width * 3 / 4 - 1, height / 3 - top, width * 3 / 4, height - 1 - top, t_solid);
+        break;
+    }
+    case scenario_sand_into_water:
+    {
+        world.FillRect(0, height / 2 - top, width - 1, height - 1 - top, t_water);
+        world.FillRect(width / 3, 0 - top, width * 2 / 3, height / 4 - top, t_sand);
+        break;
+    }
+    case scenario_full_world_rain:
+    {
+        world.FillRect(0, 0 - top, width - 1, height / 2 - top, t_sand, 0.05);
+        world.FillRect(0, 0 - top, width - 1, height / 2 - top, t_water, 0.05);
+        break;
+    }
+    case scenario_mostly_settled:
+    {
+        world.FillRect(0, height * 2 / 5 - top, width - 1, height * 7 / 10 - top, t_water);
+        world.FillRect(0, height * 7 / 10 + 1 - top, width - 1, height - 1 - top, t_sand);
+        world.FillRect(width / 2 - 4, 0 - top, width / 2 + 4, 8 - top, t_sand);
+        break;
+    }
+    case scenario_solid_maze:
+    {
+        // horizontal walls every 16 rows with one gap per wall segment, alternating sides
+        for (int y = 16; y < height; y += 16)
+        {
+            for (int x = 0; x < width; x += 32)
+            {
+                int gap = x + ((y / 16) % 2 ? 4 : 24);
+                world.FillRect(x, y - top, std::min(x + 31, width - 1), y - top, t_solid);
+                world.FillRect(gap, y - top, std::min(gap + 3, width - 1), y - top, t_air);
+            }
+        }
+        world.FillRect(0, 0 - top, width - 1, 14 - top, t_sand, 0.3);
+        world.FillRect(0, 0 - top, width - 1, 14 - top, t_water, 0.3);
+        break;
+    }
+    case scenario_heated_sand:
+    {
+        // a sand heap and a pool on a solid floor with a burner underneath, see StepScenario
+        world.FillRect(0, height - 4 - top, width - 1, height - 1 - top, t_solid);
+        world.FillRect(width / 8, height / 2 - top, width / 2, height - 5 - top, t_sand);
+        world.FillRect(width * 5 / 8, height * 3 / 4 - top, width * 7 / 8, height - 5 - top, t_water);
+        break;
+    }
+    case scenario_body_drop:
+    {
+        // crates of different sizes dropped into a pool next to a sand heap
+        world.FillRect(0, height - 2 - top, width - 1, height - 1 - top, t_solid);
+        world.FillRect(0, height * 2 / 3 - top, width / 2, height - 3 - top, t_water);
+        world.FillRect(width * 2 / 3, height * 3 / 4 - top, width - 1, height - 3 - top, t_sand);
+        for (int i = 0; i < 4; i++)
+        {
+            float size = 8.0f + 4.0f * i;
+            world.AddBody(BoxShape(size * 1.5f, size), Vector2{width * (0.1f + 0.22f * i), height * 0.15f - top}, 0.3f * i,
+                          Vector2{0.5f, 0.0f}, 0.02f);
+        }
+        break;
+    }
+    case scenario_explosions:
+    {
+        world.FillRect(0, height / 2 - top, width - 1, height - 1 - top, t_sand);
+        world.FillRect(0, height / 3 - top, width - 1, height / 2 - 1 - top, t_water);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// per-step emitters for scenarios that keep adding material. width and height are the scenario's; the
+// world may hold only its rows from top down, as a strip does, and then only emits into its owned rows
+void StepScenario(ParticleWorld &world, Scenario scenario, int width, int height, int top = 0)
+{
+    switch (scenario)
+    {
+    case scenario_water_tank_fill:
+    {
+        world.FillRect(width / 2 - 6, 0 - top, width / 2 + 6, 1 - top, t_water, 0.5);
+        break;
+    }
+    case scenario_full_world_rain:
+    {
+        world.FillRect(0, 0 - top, width - 1, 0 - top, t_water, 0.02);
+        world.FillRect(0, 0 - top, width - 1, 0 - top, t_sand, 0.02);
+        break;
+    }
+    case scenario_mostly_settled:
+    {
+        world.FillRect(width / 2 - 2, 0 - top, width / 2 + 2, 0 - top, t_sand, 0.2);
+        break;
+    }
+    case scenario_explosions:
+    {
+        // a blast somewhere below the surface every 20 steps
+        if (std::rand() % 20 == 0)
+            world.ApplyImpulse(std::rand() % width, height / 2 + std::rand() % std::max(height / 4, 1) - top, 20, 30.0f);
+        break;
+    }
+    case scenario_heated_sand:
+    {
+        world.AddHeat(width * 5 / 16, height - 3 - top, 12, 25.0f);
+        world.AddHeat(width * 3 / 4, height - 3 - top, 12, 4.0f);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// scenarios with rigid bodies, which strip runs cannot split
+bool ScenarioHasBodies(Scenario scenario)
+{
+    return scenario == scenario_body_drop;
+}
+
+Scenario ScenarioFromName(const char *name)
+{
+    for (int i = 0; i < scenario_count; i++)
+        if (std::strcmp(name, scenarioNames[i]) == 0)
+            return (Scenario)i;
+    return scenario_count;
+}
@@ -0,0 +1,203 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include "particle.h"
+
+// Checkpoints of the grid: cell types, colors and lifetimes, chunk by chunk. Rigid bodies, flying particles,
+// velocities and the heat and pressure fields are not saved; loading leaves their cells as plain grid cells.
+//
+// SnapshotWriter saves without pausing the simulation. Begin attaches a CowEpoch to the world, which
+// freezes its contents at that step: a background thread streams the chunks to disk, reading untouched
+// ones from the live world and the ones the simulation has written since from the copies made on their
+// first write.
+
+#define SNAPSHOT_MAGIC 0x50534143u // "CASP"
+#define SNAPSHOT_VERSION 1
+
+struct SnapshotHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t chunkSize;
+    int32_t chunks;
+};
+
+class SnapshotWriter
+{
+public:
+    ~SnapshotWriter() { Wait(); }
+    bool Begin(ParticleWorld &world, const std::string &path); // false if a save is already running or the file can't be opened
+    bool Poll(); // call between steps; once the save is written, detaches it from the world and returns true
+    void Wait(); // blocks until the running save is written, then detaches it
+    bool const isSaving() { return _epoch != nullptr; }
+    bool const getSucceeded() { return _succeeded; }
+    int const getCopiedChunks() { return _copiedChunks; } // chunks the simulation copied before the writer reached them
+    double const getSaveMs() { return _saveMs; }
+
+private:
+    void Run();
+    ParticleWorld *_world = nullptr;
+    std::unique_ptr<CowEpoch> _epoch;
+    std::ofstream _file;
+    std::thread _thread;
+    std::atomic<bool> _done{false};
+    std::chrono::steady_clock::time_point _start;
+    bool _succeeded = false;
+    int _copiedChunks = 0;
+    double _saveMs = 0.0;
+};
+
+bool SaveSnapshot(ParticleWorld &world, const std::string &path); // synchronous, for tools and comparisons
+bool LoadSnapshot(ParticleWorld &world, const std::string &path);
+
+static void WriteChunkImage(std::ofstream &file, const ChunkImage &image)
+{
+    int32_t rect[5] = {image.chunk, image.x, image.y, image.width, image.height};
+    file.write((const char *)rect, sizeof(rect));
+    file.write((const char *)image.types.data(), image.types.size());
+    file.write((const char *)image.colors.data(), image.colors.size() * sizeof(Color));
+    file.write((const char *)image.life.data(), image.life.size() * sizeof(int));
+}
+
+static SnapshotHeader MakeSnapshotHeader(ParticleWorld &world)
+{
+    return SnapshotHeader{SNAPSHOT_MAGIC, SNAPSHOT_VERSION, world.getWidth(), world.getHeight(), CHUNK_SIZE,
+                          world.getChunksX() * world.getChunksY()};
+}
+
+bool SnapshotWriter::Begin(ParticleWorld &world, const std::string &path)
+{
+    if (isSaving())
+        return false;
+    _file.open(path, std::ios::binary | std::ios::trunc);
+    if (!_file)
+    {
+        _file.clear();
+        return false;
+    }
+    SnapshotHeader header = MakeSnapshotHeader(world);
+    _file.write((const char *)&header, sizeof(header));
+    _world = &world;
+    _epoch.reset(new CowEpoch(header.chunks));
+    _world->AttachEpoch(_epoch.get());
+    _done = false;
+    _succeeded = false;
+    _start = std::chrono::steady_clock::now();
+    _thread = std::thread(&SnapshotWriter::Run, this);
+    return true;
+}
+
+void SnapshotWriter::Run()
+{
+    ChunkImage scratch;
+    for (int chunk = 0; chunk < _epoch->getChunks(); chunk++)
+    {
+        if (_epoch->BeginRead(chunk))
+        {
+            _world->CaptureChunk(chunk, scratch);
+            _epoch->DoneReading(chunk);
+            WriteChunkImage(_file, scratch);
+        }
+        else
+        {
+            // the simulation is done with the copy once it is made; free it as soon as it is on disk
+            ChunkImage &image = _epoch->Image(chunk);
+            WriteChunkImage(_file, image);
+            image = ChunkImage();
+        }
+    }
+    _file.flush();
+    _succeeded = (bool)_file;
+    _file.close();
+    _done.store(true, std::memory_order_release);
+}
+
+bool SnapshotWriter::Poll()
+{
+    if (!isSaving() || !_done.load(std::memory_order_acquire))
+        return false;
+    if (_thread.joinable())
+        _thread.join();
+    _copiedChunks = 0;
+    for (int chunk = 0; chunk < _epoch->getChunks(); chunk++)
+        _copiedChunks += _epoch->IsCopied(chunk);
+    _world->DetachEpoch(_epoch.get());
+    _epoch.reset();
+    _saveMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - _start).count();
+    return true;
+}
+
+void SnapshotWriter::Wait()
+{
+    if (_thread.joinable())
+        _thread.join();
+    Poll();
+}
+
+bool SaveSnapshot(ParticleWorld &world, const std::string &path)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+    SnapshotHeader header = MakeSnapshotHeader(world);
+    file.write((const char *)&header, sizeof(header));
+    ChunkImage image;
+    for (int chunk = 0; chunk < header.chunks; chunk++)
+    {
+        world.CaptureChunk(chunk, image);
+        WriteChunkImage(file, image);
+    }
+    return (bool)file;
+}
+
+bool LoadSnapshot(ParticleWorld &world, const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    SnapshotHeader header;
+    if (!file.read((char *)&header, sizeof(header)))
+        return false;
+    SnapshotHeader expected = MakeSnapshotHeader(world);
+    if (header.magic != expected.magic || header.version != expected.version || header.width != expected.width ||
+        header.height != expected.height || header.chunkSize != expected.chunkSize || header.chunks != expected.chunks)
+        return false;
+    // read everything before touching the world so a truncated file leaves it as it was
+    std::vector<ChunkImage> images(header.chunks);
+    for (ChunkImage &image : images)
+    {
+        int32_t rect[5];
+        if (!file.read((char *)rect, sizeof(rect)) || rect[0] < 0 || rect[0] >= header.chunks)
+            return false;
+        Rectangle bounds = world.ChunkBounds(rect[0]);
+        if (rect[1] != (int)bounds.x || rect[2] != (int)bounds.y || rect[3] != (int)bounds.width || rect[4] != (int)bounds.height)
+            return false;
+        image.chunk = rect[0];
+        image.x = rect[1];
+        image.y = rect[2];
+        image.width = rect[3];
+        image.height = rect[4];
+        int cells = image.width * image.height;
+        image.types.resize(cells);
+        image.colors.resize(cells);
+        image.life.resize(cells);
+        file.read((char *)image.types.data(), cells);
+        file.read((char *)image.colors.data(), cells * sizeof(Color));
+        file.read((char *)image.life.data(), cells * sizeof(int));
+        if (!file)
+            return false;
+        for (unsigned char type : image.types)
+            if (type >= MAT_COUNT)
+                return false;
+    }
+    world.ClearBodies();
+    world.ClearFlying();
+    for (const ChunkImage &image : images)
+        world.RestoreChunk(image);
+    return true;
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <vector>
+
+#define THERMAL_AMBIENT 20.0f  // degrees every cell starts at and relaxes back to
+#define THERMAL_MAX 3000.0f    // heat sources are clamped here
+#define THERMAL_COOLING 0.002f // fraction of the excess over ambient lost per step
+#define THERMAL_SCALE 2        // default world cells per side of one thermal cell
+
+// Temperature of the world on its own grid, optionally coarser than the cells (scale world cells per side
+// of one thermal cell). Each step is an explicit 5-point diffusion whose per-cell rate comes from the
+// conductivity of the materials it covers. Once everything is back at ambient the field goes idle and
+// stepping it costs nothing until heat is added again.
+class ThermalField
+{
+public:
+    void Resize(int width, int height, int scale);
+    void Build(const unsigned char *types, const float *conductivity); // conductivity indexed by material
+    void Diffuse();
+    // world coordinates, only into the thermal rows covering world rows top..bottom; negative amounts cool
+    void AddHeat(int x, int y, int radius, float amount, int top = 0, int bottom = INT_MAX);
+    void AddHeatAt(int cx, int cy, float amount) { _temp[Index(cx, cy)] += amount; }
+    float TemperatureAt(int x, int y) { return _temp[Index(x / _scale, y / _scale)]; }
+    float CellTemperature(int cx, int cy) { return _temp[Index(cx, cy)]; }
+    void Reset();
+    bool const isIdle() { return _idle; }
+    int const getScale() { return _scale; }
+    int const getCoarseWidth() { return _cw; }
+    int const getCoarseHeight() { return _ch; }
+
+private:
+    int Index(int cx, int cy) { return (cy + 1) * _stride + (cx + 1); } // one cell of ambient padding on every side
+    int _width = 0;
+    int _height = 0;
+    int _scale = 1;
+    int _cw = 0;
+    int _ch = 0;
+    int _stride = 0;
+    bool _idle = true;
+    std::vector<float> _temp;
+    std::vector<float> _next;
+    std::vector<float> _rate; // diffusion rate per thermal cell, 0 on the padding so it stays at ambient
+    std::vector<float> _conductivitySum;
+};
+
+void ThermalField::Resize(int width, int height, int scale)
+{
+    _width = width;
+    _height = height;
+    _scale = std::max(scale, 1);
+    _cw = (width + _scale - 1) / _scale;
+    _ch = (height + _scale - 1) / _scale;
+    _stride = _cw + 2;
+    int size = _stride * (_ch + 2);
+    _temp.assign(size, THERMAL_AMBIENT);
+    _next.assign(size, THERMAL_AMBIENT);
+    _rate.assign(size, 0.0f);
+    _conductivitySum.assign(_cw, 0.0f);
+    _idle = true;
+}
+
+void ThermalField::Reset()
+{
+    std::fill(_temp.begin(), _temp.end(), THERMAL_AMBIENT);
+    _idle = true;
+}
+
+void ThermalField::Build(const unsigned char *types, const float *conductivity)
+{
+    if (_idle)
+        return;
+    float invArea = 1.0f / (_scale * _scale);
+    for (int cy = 0; cy < _ch; cy++)
+    {
+        std::fill(_conductivitySum.begin(), _conductivitySum.end(), 0.0f);
+        int y1 = std::min((cy + 1) * _scale, _height);
+        for (int y = cy * _scale; y < y1; y++)
+        {
+            const unsigned char *row = types + y * _width;
+            for (int cx = 0; cx < _cw; cx++)
+            {
+                int x0 = cx * _scale;
+                int x1 = std::min(x0 + _scale, _width);
+                float sum = 0.0f;
+                for (int x = x0; x < x1; x++)
+                    sum += conductivity[row[x]];
+                _conductivitySum[cx] += sum;
+            }
+        }
+        // partial cells on the right and bottom edge count their missing area as non-conducting
+        float *rate = &_rate[Index(0, cy)];
+        for (int cx = 0; cx < _cw; cx++)
+            rate[cx] = std::min(0.24f, _conductivitySum[cx] * invArea);
+    }
+}
+
+void ThermalField::Diffuse()
+{
+    if (_idle)
+        return;
+    int first = _stride + 1;
+    int last = _stride * (_ch + 1) - 1;
+    const float *t = _temp.data();
+    const float *rate = _rate.data();
+    float *out = _next.data();
+    float hottest = 0.0f;
+    // branch-free so the sweep vectorizes; padding cells have rate 0 and sit at ambient
+    for (int i = first; i < last; i++)
+    {
+        float laplacian = t[i - 1] + t[i + 1] + t[i - _stride] + t[i + _stride] - 4.0f * t[i];
+        float value = t[i] + rate[i] * laplacian;
+        value -= (value - THERMAL_AMBIENT) * THERMAL_COOLING * (rate[i] > 0.0f);
+        out[i] = value;
+        hottest = std::max(hottest, std::abs(value - THERMAL_AMBIENT));
+    }
+    _temp.swap(_next);
+    if (hottest < 0.5f)
+        Reset();
+}
+
+void ThermalField::AddHeat(int x, int y, int radius, float amount, int top, int bottom)
+{
+    int cx = x / _scale;
+    int cy = y / _scale;
+    int r = std::max(radius / _scale, 0);
+    for (int oy = -r; oy <= r; oy++)
+    {
+        int ty = cy + oy;
+        if (ty < std::max(top / _scale, 0) || ty >= std::min(bottom / _scale + 1, _ch))
+            continue;
+        int half = (int)std::sqrt((double)(r * r - oy * oy));
+        for (int tx = std::max(cx - half, 0); tx <= std::min(cx + half, _cw - 1); tx++)
+        {
+            float &t = _temp[Index(tx, ty)];
+            t = std::max(-273.0f, std::min(THERMAL_MAX, t + amount));
+        }
+    }
+    _idle = false;
+}
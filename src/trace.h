@@ -0,0 +1,150 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Chrome trace-event recorder; load the written file in chrome://tracing or ui.perfetto.dev.
+// Define NO_TRACE to compile all TRACE_* macros out.
+
+struct TraceEvent
+{
+    const char *name; // must be a string literal or otherwise outlive the trace
+    char phase;       // 'X' complete event, 'C' counter
+    double ts;        // microseconds since Begin
+    double dur;
+    int tid;
+    std::string args; // json object body without braces
+};
+
+class TraceWriter
+{
+public:
+    static TraceWriter &Get();
+    bool Begin(const std::string &path); // false if the file cannot be opened for writing
+    void End(); // writes the collected events and stops recording
+    bool const isEnabled() { return _enabled.load(std::memory_order_relaxed); }
+    double Now() { return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - _origin).count(); }
+    void AddComplete(const char *name, double ts, double dur, std::string args);
+    void AddCounter(const char *name, double value);
+    static int ThreadId();
+
+private:
+    TraceWriter() {}
+    std::atomic<bool> _enabled{false};
+    std::mutex _mutex;
+    std::vector<TraceEvent> _events;
+    std::ofstream _out;
+    std::chrono::steady_clock::time_point _origin;
+};
+
+class TraceScope
+{
+public:
+    TraceScope(const char *name) : _name(name)
+    {
+        _active = name != nullptr && TraceWriter::Get().isEnabled();
+        if (_active)
+            _start = TraceWriter::Get().Now();
+    }
+    ~TraceScope()
+    {
+        if (_active)
+            TraceWriter::Get().AddComplete(_name, _start, TraceWriter::Get().Now() - _start, _args);
+    }
+    void setArgs(const std::string &args) { _args = args; } // e.g. "\"sand\":12,\"water\":3"
+    bool const isActive() { return _active; }
+
+private:
+    const char *_name;
+    double _start = 0.0;
+    bool _active;
+    std::string _args;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#ifndef NO_TRACE
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(_traceScope, __LINE__)(name)
+#define TRACE_SCOPE_NAMED(var, name) TraceScope var(name)
+#define TRACE_COUNTER(name, value)                      \
+    do                                                  \
+    {                                                   \
+        if (TraceWriter::Get().isEnabled())             \
+            TraceWriter::Get().AddCounter(name, value); \
+    } while (0)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_NAMED(var, name) TraceScope var(nullptr)
+#define TRACE_COUNTER(name, value)
+#endif
+
+TraceWriter &TraceWriter::Get()
+{
+    static TraceWriter instance;
+    return instance;
+}
+
+int TraceWriter::ThreadId()
+{
+    static std::atomic<int> nextId{1};
+    thread_local int id = nextId++;
+    return id;
+}
+
+bool TraceWriter::Begin(const std::string &path)
+{
+    End();
+    std::lock_guard<std::mutex> lock(_mutex);
+    // opened up front so a bad path is reported before any events are collected
+    _out.open(path);
+    if (!_out.is_open())
+    {
+        std::cerr << "could not write trace to " << path << std::endl;
+        return false;
+    }
+    _events.clear();
+    _origin = std::chrono::steady_clock::now();
+    _enabled = true;
+    return true;
+}
+
+void TraceWriter::End()
+{
+    if (!_enabled.exchange(false))
+        return;
+    std::lock_guard<std::mutex> lock(_mutex);
+    _out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (size_t i = 0; i < _events.size(); i++)
+    {
+        TraceEvent &e = _events[i];
+        _out << "{\"name\":\"" << e.name << "\",\"ph\":\"" << e.phase << "\",\"pid\":1,\"tid\":" << e.tid
+             << ",\"ts\":" << std::fixed << e.ts;
+        if (e.phase == 'X')
+            _out << ",\"dur\":" << e.dur;
+        _out << ",\"args\":{" << e.args << "}}" << (i + 1 < _events.size() ? ",\n" : "\n");
+    }
+    _out << "]}\n";
+    _out.close();
+    _events.clear();
+}
+
+void TraceWriter::AddComplete(const char *name, double ts, double dur, std::string args)
+{
+    int tid = ThreadId();
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_enabled)
+        _events.push_back(TraceEvent{name, 'X', ts, dur, tid, std::move(args)});
+}
+
+void TraceWriter::AddCounter(const char *name, double value)
+{
+    double ts = Now();
+    int tid = ThreadId();
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_enabled)
+        _events.push_back(TraceEvent{name, 'C', ts, 0.0, tid, "\"value\":" + std::to_string(value)});
+}
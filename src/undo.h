@@ -0,0 +1,136 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <vector>
+#include "particle.h"
+
+#define UNDO_BUDGET_BYTES (64 << 20) // oldest edits are forgotten past this much stored chunk data
+#define UNDO_MAX_EDITS 100
+
+// Undo and redo for edits of the grid, stored as before-images of the chunks an edit wrote to. While an
+// edit is being recorded a CowEpoch is attached to the world around the edit's own writes only, so the
+// simulation running between the frames of a brush stroke does not add chunks. Undoing restores the
+// recorded chunks, which also rewinds whatever the simulation did inside them since; rigid bodies are
+// not rewound.
+class UndoHistory
+{
+public:
+    void BeginEdit(ParticleWorld &world); // starts a new edit; it may span several frames
+    void Attach(ParticleWorld &world) { if (_epoch) world.AttachEpoch(_epoch.get()); }
+    void Detach(ParticleWorld &world) { if (_epoch) world.DetachEpoch(_epoch.get()); }
+    void EndEdit();
+    bool const isEditing() { return _epoch != nullptr; }
+    bool Undo(ParticleWorld &world);
+    bool Redo(ParticleWorld &world);
+    int const getUndoCount() { return (int)_undo.size(); }
+    int const getRedoCount() { return (int)_redo.size(); }
+    size_t const getBytes() { return _bytes; }
+
+private:
+    struct Edit
+    {
+        std::vector<ChunkImage> images;
+        size_t bytes = 0;
+    };
+    static size_t ImageBytes(const ChunkImage &image);
+    // captures the current contents of the chunks in from, restores from, and returns the capture
+    Edit Swap(ParticleWorld &world, const Edit &from);
+    void Trim();
+
+    std::unique_ptr<CowEpoch> _epoch;
+    std::deque<Edit> _undo;
+    std::deque<Edit> _redo;
+    size_t _bytes = 0; // stored in both stacks
+};
+
+size_t UndoHistory::ImageBytes(const ChunkImage &image)
+{
+    return sizeof(ChunkImage) + image.types.size() + image.colors.size() * sizeof(Color) + image.life.size() * sizeof(int);
+}
+
+void UndoHistory::BeginEdit(ParticleWorld &world)
+{
+    if (_epoch)
+        EndEdit();
+    _epoch.reset(new CowEpoch(world.getChunksX() * world.getChunksY()));
+}
+
+void UndoHistory::EndEdit()
+{
+    if (!_epoch)
+        return;
+    Edit edit;
+    for (int chunk = 0; chunk < _epoch->getChunks(); chunk++)
+    {
+        if (!_epoch->IsCopied(chunk))
+            continue;
+        edit.images.push_back(std::move(_epoch->Image(chunk)));
+        edit.bytes += ImageBytes(edit.images.back());
+    }
+    _epoch.reset();
+    if (edit.images.empty())
+        return;
+    for (Edit &old : _redo)
+        _bytes -= old.bytes;
+    _redo.clear();
+    _bytes += edit.bytes;
+    _undo.push_back(std::move(edit));
+    Trim();
+}
+
+UndoHistory::Edit UndoHistory::Swap(ParticleWorld &world, const Edit &from)
+{
+    Edit current;
+    current.images.resize(from.images.size());
+    for (size_t i = 0; i < from.images.size(); i++)
+    {
+        world.CaptureChunk(from.images[i].chunk, current.images[i]);
+        current.bytes += ImageBytes(current.images[i]);
+    }
+    for (const ChunkImage &image : from.images)
+        world.RestoreChunk(image);
+    return current;
+}
+
+bool UndoHistory::Undo(ParticleWorld &world)
+{
+    EndEdit();
+    if (_undo.empty())
+        return false;
+    Edit edit = std::move(_undo.back());
+    _undo.pop_back();
+    Edit after = Swap(world, edit);
+    _bytes = _bytes - edit.bytes + after.bytes;
+    _redo.push_back(std::move(after));
+    Trim();
+    return true;
+}
+
+bool UndoHistory::Redo(ParticleWorld &world)
+{
+    EndEdit();
+    if (_redo.empty())
+        return false;
+    Edit edit = std::move(_redo.back());
+    _redo.pop_back();
+    Edit before = Swap(world, edit);
+    _bytes = _bytes - edit.bytes + before.bytes;
+    _undo.push_back(std::move(before));
+    Trim();
+    return true;
+}
+
+void UndoHistory::Trim()
+{
+    // the oldest undo steps go first, then the farthest redo steps
+    while ((_bytes > UNDO_BUDGET_BYTES || (int)_undo.size() > UNDO_MAX_EDITS) && !_undo.empty())
+    {
+        _bytes -= _undo.front().bytes;
+        _undo.pop_front();
+    }
+    while ((_bytes > UNDO_BUDGET_BYTES || (int)_redo.size() > UNDO_MAX_EDITS) && !_redo.empty())
+    {
+        _bytes -= _redo.front().bytes;
+        _redo.pop_front();
+    }
+}
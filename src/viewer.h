@@ -0,0 +1,395 @@
+#pragma once
+#include <raylib.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include "particle.h"
+#include "export.h"
+#include "scenarios.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Shared-memory view of a running simulation. A headless process publishes every step's types and
+// colors into a ring of slots in a named POSIX shared memory object, and any number of viewer processes
+// map it and draw the newest complete slot. The publisher never waits for viewers: each slot
+// carries a sequence number that is odd while it is being written, and a viewer that sees it change
+// while reading simply drops that frame.
+
+#define VIEW_SHM_NAME "/cellular-automata-view"
+#define VIEW_RING_SLOTS 4
+#define VIEW_MAGIC 0x43415631u // "CAV1"
+
+struct ViewSlot
+{
+    std::atomic<uint64_t> sequence{0}; // 2 * step + 1 while writing, 2 * step + 2 once complete
+    uint64_t step = 0;
+    SimStats stats;
+};
+
+struct ViewHeader
+{
+    uint32_t magic = 0;
+    int width = 0;
+    int height = 0;
+    int slots = 0;
+    size_t slotBytes = 0;
+    std::atomic<uint64_t> published{0}; // steps published so far; the newest is in slot (published - 1) % slots
+    std::atomic<int> viewers{0};
+    std::atomic<int> closed{0}; // set when the publisher exits
+};
+
+// byte offsets inside the mapping shared by publisher and viewers
+struct ViewLayout
+{
+    size_t headerBytes;
+    size_t slotHeaderBytes;
+    size_t typesBytes;
+    size_t slotBytes;
+    size_t totalBytes;
+
+    ViewLayout(int width, int height);
+    ViewSlot *Slot(char *base, int i) { return (ViewSlot *)(base + headerBytes + i * slotBytes); }
+    unsigned char *Types(char *base, int i) { return (unsigned char *)Slot(base, i) + slotHeaderBytes; }
+    Color *Colors(char *base, int i) { return (Color *)(Types(base, i) + typesBytes); }
+};
+
+class ViewPublisher
+{
+public:
+    ~ViewPublisher() { Close(); }
+    bool Open(const char *name, int width, int height); // creates or replaces the shared object
+    void Publish(ParticleWorld &world, uint64_t step);
+    void Close(); // unlinks the object; attached viewers keep their mapping and see closed set
+    int const getViewers() { return _header ? _header->viewers.load() : 0; }
+
+private:
+    char *_base = nullptr;
+    ViewHeader *_header = nullptr;
+    size_t _bytes = 0;
+    std::string _name;
+};
+
+class ViewSubscriber
+{
+public:
+    ~ViewSubscriber() { Close(); }
+    bool Open(const char *name); // false while no publisher has created the object
+    // uploads the newest complete slot newer than the last one into texture; false if there is none or it tore
+    bool Upload(Texture2D &texture);
+    void Close();
+    bool const isOpen() { return _header != nullptr; }
+    bool const isClosed() { return _header && _header->closed.load(); }
+    int const getWidth() { return _header ? _header->width : 0; }
+    int const getHeight() { return _header ? _header->height : 0; }
+    uint64_t const getStep() { return _step; }
+    uint64_t const getPublished() { return _header ? _header->published.load() : 0; }
+    long const getTorn() { return _torn; }
+    SimStats const &getStats() { return _stats; }
+
+private:
+    char *_base = nullptr;
+    ViewHeader *_header = nullptr;
+    size_t _bytes = 0;
+    uint64_t _seen = 0; // value of published when the last slot was taken
+    uint64_t _step = 0;
+    long _torn = 0;
+    SimStats _stats;
+    std::vector<Color> _colors; // the slot being read, checked before it is uploaded
+};
+
+// headless simulation publishing to name, and to exporter if given, until steps (0 = until interrupted);
+// returns a process exit code
+int RunHeadless(const char *name, Scenario scenario, int width, int height, int steps, unsigned seed, double dt, FrameExporter *exporter);
+// window drawing whatever the publisher at name sends; returns a process exit code
+int RunViewer(const char *name, int screenWidth, int screenHeight);
+
+static size_t ViewAlign(size_t value) { return (value + 63) & ~(size_t)63; }
+
+ViewLayout::ViewLayout(int width, int height)
+{
+    headerBytes = ViewAlign(sizeof(ViewHeader));
+    slotHeaderBytes = ViewAlign(sizeof(ViewSlot));
+    typesBytes = ViewAlign(width * height);
+    slotBytes = slotHeaderBytes + typesBytes + ViewAlign(width * height * sizeof(Color));
+    totalBytes = headerBytes + VIEW_RING_SLOTS * slotBytes;
+}
+
+#ifndef _WIN32
+
+bool ViewPublisher::Open(const char *name, int width, int height)
+{
+    Close();
+    ViewLayout layout(width, height);
+    shm_unlink(name); // a stale object from a crashed run may have another size
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        std::perror("shm_open");
+        return false;
+    }
+    if (ftruncate(fd, layout.totalBytes) != 0)
+    {
+        std::perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void *mapping = mmap(nullptr, layout.totalBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        std::perror("mmap");
+        shm_unlink(name);
+        return false;
+    }
+    _base = (char *)mapping;
+    _bytes = layout.totalBytes;
+    _name = name;
+    for (int i = 0; i < VIEW_RING_SLOTS; i++)
+        new (layout.Slot(_base, i)) ViewSlot();
+    _header = new (_base) ViewHeader();
+    _header->width = width;
+    _header->height = height;
+    _header->slots = VIEW_RING_SLOTS;
+    _header->slotBytes = layout.slotBytes;
+    // viewers check the magic last, so everything above is in place once they see it
+    std::atomic_thread_fence(std::memory_order_release);
+    _header->magic = VIEW_MAGIC;
+    return true;
+}
+
+void ViewPublisher::Publish(ParticleWorld &world, uint64_t step)
+{
+    if (!_header)
+        return;
+    ViewLayout layout(_header->width, _header->height);
+    int i = (int)(_header->published.load(std::memory_order_relaxed) % VIEW_RING_SLOTS);
+    ViewSlot *slot = layout.Slot(_base, i);
+    slot->sequence.store(2 * step + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->step = step;
+    slot->stats = world.getStats();
+    unsigned char *types = layout.Types(_base, i);
+    Color *colors = layout.Colors(_base, i);
+    for (int y = 0; y < _header->height; y++)
+        world.ReadRow(y, types + y * _header->width, colors + y * _header->width);
+    slot->sequence.store(2 * step + 2, std::memory_order_release);
+    _header->published.fetch_add(1, std::memory_order_release);
+}
+
+void ViewPublisher::Close()
+{
+    if (!_header)
+        return;
+    _header->closed.store(1);
+    munmap(_base, _bytes);
+    shm_unlink(_name.c_str());
+    _base = nullptr;
+    _header = nullptr;
+}
+
+bool ViewSubscriber::Open(const char *name)
+{
+    Close();
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(ViewHeader))
+    {
+        close(fd);
+        return false;
+    }
+    // read-write only for the viewer count; the slots are never written from here
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+    ViewHeader *header = (ViewHeader *)mapping;
+    if (header->magic != VIEW_MAGIC || (size_t)info.st_size < ViewLayout(header->width, header->height).totalBytes)
+    {
+        munmap(mapping, info.st_size);
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    _base = (char *)mapping;
+    _header = header;
+    _bytes = info.st_size;
+    _seen = 0;
+    _header->viewers.fetch_add(1);
+    return true;
+}
+
+bool ViewSubscriber::Upload(Texture2D &texture)
+{
+    if (!_header)
+        return false;
+    uint64_t published = _header->published.load(std::memory_order_acquire);
+    if (published == 0 || published == _seen)
+        return false;
+    ViewLayout layout(_header->width, _header->height);
+    int i = (int)((published - 1) % VIEW_RING_SLOTS);
+    ViewSlot *slot = layout.Slot(_base, i);
+    uint64_t before = slot->sequence.load(std::memory_order_acquire);
+    if (before & 1)
+        return false;
+    // copied out first, so a frame the publisher overwrites while we read never reaches the texture
+    const Color *colors = layout.Colors(_base, i);
+    _colors.assign(colors, colors + _header->width * _header->height);
+    uint64_t step = slot->step;
+    SimStats stats = slot->stats;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence.load(std::memory_order_relaxed) != before)
+    {
+        _torn++; // the publisher lapped the ring while we read; the next frame will be clean
+        return false;
+    }
+    UpdateTexture(texture, _colors.data());
+    _seen = published;
+    _step = step;
+    _stats = stats;
+    return true;
+}
+
+void ViewSubscriber::Close()
+{
+    if (!_header)
+        return;
+    _header->viewers.fetch_sub(1);
+    munmap(_base, _bytes);
+    _base = nullptr;
+    _header = nullptr;
+}
+
+int RunViewer(const char *name, int screenWidth, int screenHeight)
+{
+    InitWindow(screenWidth, screenHeight, "Cellular Automata viewer");
+    SetTargetFPS(60);
+    ViewSubscriber subscriber;
+    Texture2D texture = {0};
+    while (!WindowShouldClose())
+    {
+        // attach whenever a publisher appears, and let go when it exits
+        if (subscriber.isClosed())
+        {
+            subscriber.Close();
+            UnloadTexture(texture);
+            texture = Texture2D{0};
+        }
+        if (!subscriber.isOpen() && subscriber.Open(name))
+        {
+            Image image = GenImageColor(subscriber.getWidth(), subscriber.getHeight(), BLACK);
+            texture = LoadTextureFromImage(image);
+            UnloadImage(image);
+        }
+        if (subscriber.isOpen())
+            subscriber.Upload(texture);
+
+        BeginDrawing();
+        ClearBackground(BLACK);
+        if (subscriber.isOpen())
+        {
+            Rectangle source = {0.0f, 0.0f, (float)texture.width, (float)texture.height};
+            Rectangle dest = {0.0f, 0.0f, (float)GetScreenWidth(), (float)GetScreenHeight()};
+            DrawTexturePro(texture, source, dest, Vector2{0.0f, 0.0f}, 0.0f, WHITE);
+            SimStats const &stats = subscriber.getStats();
+            DrawText(TextFormat("step %llu  behind %llu  torn %ld  swapped %ld", (unsigned long long)subscriber.getStep(),
+                                (unsigned long long)(subscriber.getPublished() - 1 - subscriber.getStep()), subscriber.getTorn(),
+                                stats.swapsApplied),
+                     10, 10, 10, LIME);
+        }
+        else
+            DrawText(TextFormat("waiting for a simulation on %s", name), 10, 10, 20, LIME);
+        DrawFPS(GetScreenWidth() - 95, 10);
+        EndDrawing();
+    }
+    subscriber.Close();
+    if (texture.id)
+        UnloadTexture(texture);
+    CloseWindow();
+    return 0;
+}
+
+#else
+
+bool ViewPublisher::Open(const char *name, int width, int height) { return false; }
+void ViewPublisher::Publish(ParticleWorld &world, uint64_t step) {}
+void ViewPublisher::Close() {}
+bool ViewSubscriber::Open(const char *name) { return false; }
+bool ViewSubscriber::Upload(Texture2D &texture) { return false; }
+void ViewSubscriber::Close() {}
+
+int RunViewer(const char *name, int screenWidth, int screenHeight)
+{
+    std::fprintf(stderr, "the shared-memory view needs POSIX shm_open\n");
+    return 1;
+}
+
+#endif
+
+static volatile std::sig_atomic_t headlessInterrupted = 0;
+
+int RunHeadless(const char *name, Scenario scenario, int width, int height, int steps, unsigned seed, double dt, FrameExporter *exporter)
+{
+    ViewPublisher publisher;
+    if (!publisher.Open(name, width, height))
+    {
+        // without a publisher the frames only go to the exporter, and without one the run would be for nothing
+        if (!exporter)
+        {
+            std::fprintf(stderr, "could not publish to %s\n", name);
+            return 1;
+        }
+        std::fprintf(stderr, "no viewers can attach\n");
+    }
+    std::signal(SIGINT, [](int) { headlessInterrupted = 1; });
+    std::signal(SIGTERM, [](int) { headlessInterrupted = 1; });
+
+    std::srand(seed);
+    ParticleWorld world(width, height);
+    world.setDeltaTime(dt);
+    BuildScenario(world, scenario, width, height);
+    // progress goes to stderr since raw export owns stdout
+    std::fprintf(stderr, "running %s (%dx%d), publishing to %s\n", scenarioNames[scenario], width, height, name);
+
+    auto reportStart = std::chrono::steady_clock::now();
+    uint64_t reportStep = 0;
+    uint64_t step = 0;
+    while (!headlessInterrupted && (steps <= 0 || step < (uint64_t)steps))
+    {
+        StepScenario(world, scenario, width, height);
+        world.UpdateParticles();
+        publisher.Publish(world, step);
+        if (exporter)
+            exporter->Capture(world, (long)step);
+        step++;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - reportStart).count();
+        if (elapsed >= 1.0)
+        {
+            std::fprintf(stderr, "step %llu: %.1f steps/s, %d viewers\n", (unsigned long long)step, (step - reportStep) / elapsed,
+                         publisher.getViewers());
+            reportStart = std::chrono::steady_clock::now();
+            reportStep = step;
+        }
+    }
+    publisher.Close();
+    if (exporter)
+    {
+        exporter->Close();
+        std::fprintf(stderr, "exported %ld frames, %ld failed, %.1f ms waiting on the encoders\n", exporter->getWritten(),
+                     exporter->getFailed(), exporter->getStallMs());
+        if (exporter->getFailed() > 0)
+            return 1;
+    }
+    return 0;
+}